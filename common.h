@@ -29,12 +29,58 @@
 #define SPEAKER_ON	set(PORTC, SPEAKER_PIN);
 #define SPEAKER_OFF	clr(PORTC, SPEAKER_PIN);
 
+/**
+ * Display geometry used when none is stored in EEPROM. 
+ * See layout.c.
+ */
+#ifndef DISPLAY_COLUMNS
+#define DISPLAY_COLUMNS	16
+#endif
+#ifndef DISPLAY_ROWS
+#define DISPLAY_ROWS	2
+#endif
+
+/**
+ * Number of decimals (øre) in the amounts sent by the server
+ */
+#define AMOUNT_DECIMALS	0
+
 /**
  * USB Command codes
  */
 #define CMD_ECHO				0
 #define CMD_RESPONSE			3
 #define CMD_KEEP_ALIVE			4
+#define CMD_GET_SPI_CLOCK		5
+#define CMD_SET_READ_POLICY		6
+#define CMD_GET_READ_STATS		7
+#define CMD_SET_DEDUP_WINDOW	8
+#define CMD_DOWNLOAD_BEGIN		9
+#define CMD_DOWNLOAD			10
+#define CMD_DOWNLOAD_COMMIT		11
+#define CMD_GET_DOWNLOAD_STATUS	12
+#define CMD_DISPLAY_TEXT		13
+
+/**
+ * Field number given to CMD_DISPLAY_TEXT to clear all host text
+ */
+#define DISPLAY_CLEAR_ALL		0xFF
+
+/**
+ * Size of a packet on the interrupt endpoint. Card events are the
+ * transaction ID (1 - 255), the ID length (4, 7 or 10) and the ID, 
+ * split into packets. CMD_RESPONSE gives the transaction ID in 
+ * wValue, and responses that match no pending scan are dropped.
+ */
+#define EVENT_PACKET_SIZE		8
+
+/**
+ * Telemetry records on interrupt endpoint 3, one packet each. 
+ * The first byte is the record type, numbers are little endian.
+ */
+#define TELEMETRY_STATE			1	// state, tick count
+#define TELEMETRY_STATS			2	// first try, retried, failed, dropped
+#define TELEMETRY_TRACE			3	// transaction ID, response code, ms, ms since arrival
 
 /**
  * USB Command Acknowledge Code
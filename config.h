@@ -2,9 +2,21 @@
 #ifndef _CONFIG_H_
 #define _CONFIG_H_
 
+/*
+ * The Makefile passes F_CPU. This default is only used by builds
+ * that do not.
+ */
 #ifndef F_CPU
 	#define F_CPU 16000000UL
 	//#define F_CPU	12000000UL
 #endif
 
+/*
+ * Clocks of the terminal hardware. Timings derived from F_CPU are
+ * compiled for each of them by "make check-clocks".
+ */
+#if F_CPU != 12000000UL && F_CPU != 16000000UL
+	#error "F_CPU must be 12 MHz (v1) or 16 MHz (v2)"
+#endif
+
 #endif
@@ -0,0 +1,258 @@
+/*--------------------------------------------------------
+
+download.c
+
+This file contains the download of configuration blobs
+from the host. A blob is announced with its type and length,
+and then written into a staging buffer in chunks at any
+offset, over one long control transfer or many short ones.
+An interrupted download is resumed by asking for the first
+missing offset.
+
+Nothing is applied until the host commits the download.
+The commit is carried out by the main loop, and only if
+every byte has arrived and the CRC matches. Until then the
+current configuration stays in use.
+
+Version: 	1
+Author: 	Jacob Pedersen
+Company:	IHK
+Date:		2012-12-01
+
+--------------------------------------------------------*/
+
+#include "config.h"
+#include <stdint.h>
+#include <string.h>
+#include <util/crc16.h>
+
+#include "download.h"
+#include "layout.h"
+
+/**
+ * The blob being received
+ */
+static uint8_t staging[DOWNLOAD_SIZE];
+
+/**
+ * One bit per byte of staging, set when the byte has arrived
+ */
+static uint8_t received[DOWNLOAD_SIZE / 8];
+
+/**
+ * Type and length of the blob
+ */
+static uint8_t type;
+static uint16_t length;
+
+/**
+ * Where the next chunk goes, and how many bytes are left of it
+ */
+static uint16_t write_offset;
+static uint16_t write_remaining;
+
+/**
+ * CRC given with the commit
+ */
+static uint16_t commit_crc;
+
+/**
+ * Download status. While DOWNLOAD_COMMITTING the staging
+ * buffer belongs to the main loop.
+ */
+static volatile uint8_t status = DOWNLOAD_IDLE;
+
+/**
+ * @return The first offset not received, or the length if
+ * the blob is complete
+ */
+static uint16_t
+firstMissing(void)
+{
+	uint16_t i;
+
+	for (i = 0; i < length; i++)
+	{
+		if (!(received[i / 8] & (1 << (i % 8))))
+		{
+			break;
+		}
+	}
+
+	return i;
+}
+
+/**
+ * Starts a new download, throwing away anything staged.
+ *
+ * @param blob_type One of the DOWNLOAD_* blob types
+ * @param blob_length Length of the blob in bytes
+ * @return Non-zero if the download was started
+ */
+uint8_t
+Download_Begin(uint8_t blob_type, uint16_t blob_length)
+{
+	if (status == DOWNLOAD_COMMITTING)
+	{
+		return 0;
+	}
+
+	if (blob_length == 0 || blob_length > DOWNLOAD_SIZE)
+	{
+		status = DOWNLOAD_ERR_LENGTH;
+		return 0;
+	}
+
+	memset(received, 0, sizeof(received));
+	type = blob_type;
+	length = blob_length;
+	write_remaining = 0;
+	status = DOWNLOAD_RECEIVING;
+
+	return 1;
+}
+
+/**
+ * Sets where the data of the next Download_Write calls go.
+ *
+ * @param offset Offset in the blob
+ * @param count Number of bytes that follow
+ * @return Non-zero if the chunk fits in the blob
+ */
+uint8_t
+Download_Seek(uint16_t offset, uint16_t count)
+{
+	if (status != DOWNLOAD_RECEIVING || offset > length
+		|| count > length - offset)
+	{
+		write_remaining = 0;
+		return 0;
+	}
+
+	write_offset = offset;
+	write_remaining = count;
+
+	return 1;
+}
+
+/**
+ * Stores data of the chunk set up by Download_Seek. Made to be
+ * returned from usbFunctionWrite.
+ *
+ * @param data The data
+ * @param len Number of bytes
+ * @return 1 when the chunk is complete, 0 when more data is
+ * expected and 0xFF if no chunk was set up
+ */
+uint8_t
+Download_Write(const uint8_t * data, uint8_t len)
+{
+	uint16_t i;
+
+	if (status != DOWNLOAD_RECEIVING || write_remaining == 0)
+	{
+		return 0xFF;
+	}
+
+	if (len > write_remaining)
+	{
+		len = write_remaining;
+	}
+
+	memcpy(staging + write_offset, data, len);
+	for (i = write_offset; i < write_offset + len; i++)
+	{
+		received[i / 8] |= 1 << (i % 8);
+	}
+
+	write_offset += len;
+	write_remaining -= len;
+
+	return write_remaining == 0;
+}
+
+/**
+ * Asks the main loop to apply the blob.
+ *
+ * @param crc CRC-CCITT of the blob, starting from 0xFFFF
+ */
+void
+Download_Commit(uint16_t crc)
+{
+	if (status == DOWNLOAD_RECEIVING)
+	{
+		commit_crc = crc;
+		write_remaining = 0;
+		status = DOWNLOAD_COMMITTING;
+	}
+}
+
+/**
+ * Applies a committed blob. Called from the main loop, as
+ * applying may write EEPROM and reinitialize the display.
+ *
+ * @return Non-zero if a blob was applied
+ */
+uint8_t
+Download_Poll(void)
+{
+	uint16_t i, crc = 0xFFFF;
+
+	if (status != DOWNLOAD_COMMITTING)
+	{
+		return 0;
+	}
+
+	// Not complete. Keep receiving, so the host can resume
+	if (firstMissing() != length)
+	{
+		status = DOWNLOAD_RECEIVING;
+		return 0;
+	}
+
+	for (i = 0; i < length; i++)
+	{
+		crc = _crc_ccitt_update(crc, staging[i]);
+	}
+	if (crc != commit_crc)
+	{
+		status = DOWNLOAD_ERR_CRC;
+		return 0;
+	}
+
+	if (type == DOWNLOAD_LAYOUT)
+	{
+		if (length != sizeof(struct layout_geometry))
+		{
+			status = DOWNLOAD_ERR_LENGTH;
+			return 0;
+		}
+		if (!Layout_SetGeometry((const struct layout_geometry *) staging))
+		{
+			status = DOWNLOAD_ERR_INVALID;
+			return 0;
+		}
+	}
+	else
+	{
+		status = DOWNLOAD_ERR_TYPE;
+		return 0;
+	}
+
+	status = DOWNLOAD_OK;
+	return 1;
+}
+
+/**
+ * Gets the status of the download. While receiving, missing is
+ * the offset to resume from.
+ *
+ * @param s Where to store the status
+ */
+void
+Download_GetStatus(struct download_status * s)
+{
+	s->status = status;
+	s->type = type;
+	s->missing = firstMissing();
+}
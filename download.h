@@ -0,0 +1,56 @@
+#ifndef _DOWNLOAD_H_
+#define _DOWNLOAD_H_
+
+#include <stdint.h>
+
+/**
+ * Size of the staging buffer, and so the largest blob
+ */
+#define DOWNLOAD_SIZE			256
+
+/**
+ * Blob types
+ */
+#define DOWNLOAD_LAYOUT			1	// struct layout_geometry
+
+/**
+ * Download status codes
+ */
+#define DOWNLOAD_IDLE			0
+#define DOWNLOAD_RECEIVING		1
+#define DOWNLOAD_COMMITTING		2
+#define DOWNLOAD_OK				3
+#define DOWNLOAD_ERR_LENGTH		4
+#define DOWNLOAD_ERR_CRC		5
+#define DOWNLOAD_ERR_TYPE		6
+#define DOWNLOAD_ERR_INVALID	7
+
+/**
+ * Download status as returned by Download_GetStatus
+ */
+struct download_status
+{
+	uint8_t status;
+	uint8_t type;
+	uint16_t missing;
+};
+
+uint8_t 
+Download_Begin(uint8_t type, uint16_t length);
+
+uint8_t 
+Download_Seek(uint16_t offset, uint16_t count);
+
+uint8_t 
+Download_Write(const uint8_t * data, uint8_t len);
+
+void 
+Download_Commit(uint16_t crc);
+
+uint8_t 
+Download_Poll(void);
+
+void 
+Download_GetStatus(struct download_status * status);
+
+#endif
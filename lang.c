@@ -0,0 +1,35 @@
+/*--------------------------------------------------------
+
+lang.c
+
+This file contains all translated strings. Each string is 
+stored once in flash, however many places use it. Write 
+Danish letters as they are (the file is UTF-8) and use 
+the LCD_ICON_* from lcd.h.
+
+Version: 	1
+Author: 	Jacob Pedersen
+Company:	IHK
+Date:		2012-12-01
+
+--------------------------------------------------------*/
+
+#include <avr/pgmspace.h>
+
+#include "lcd.h"
+#include "lang.h"
+
+const char L_STARTING[] PROGMEM				= "Starter...      ";
+const char L_WORKING[] PROGMEM				= "Arbejder...     ";
+const char L_SCAN_HERE[] PROGMEM			= LCD_ICON_CARD " Scan her!     ";
+const char L_CHECK_IN[] PROGMEM				= LCD_ICON_OK " Check ind     ";
+const char L_CHECK_OUT[] PROGMEM			= "Check ud";
+const char L_CHECK_OUT_TOO_LATE[] PROGMEM	= "For sent checkud";
+const char L_LATE_CHECK_OUT_FEE[] PROGMEM	= "Gebyr      50 kr";
+const char L_BALANCE[] PROGMEM				= "Saldo";
+const char L_INSUFFICIENT_FUNDS[] PROGMEM	= "Saldo for lav   ";
+const char L_INVALID_CARD[] PROGMEM			= LCD_ICON_ERROR " Ugyldigt kort ";
+const char L_OK[] PROGMEM					= LCD_ICON_OK " OK            ";
+const char L_SYSTEM_ERROR[] PROGMEM			= LCD_ICON_ERROR " SYSTEMFEJL    ";
+const char L_CURRENCY[] PROGMEM				= " kr";
+const char L_OUT_OF_ORDER[] PROGMEM			= "Ude af drift    ";
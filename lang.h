@@ -2,7 +2,10 @@
 
 lang.h
 
-This file contains all translated strings.
+This file declares all translated strings. The strings 
+are defined in lang.c and stored in flash, so they must be 
+printed with the _P functions, e.g. LCD_PutString_P or 
+Layout_SetText_P.
 
 Version: 	1
 Author: 	Jacob Pedersen
@@ -14,18 +17,21 @@ Date:		2012-12-01
 #ifndef _LANG_H_
 #define _LANG_H_
 
-#define L_STARTING				"Starter...      "
-#define L_WORKING				"Arbejder...     "
-#define L_SCAN_HERE				"Scan her!       "
-#define L_CHECK_IN				"Check ind        "
-#define L_CHECK_OUT				"Check ud  %d kr"
-#define L_CHECK_OUT_TOO_LATE	"For sent checkud"
-#define L_LATE_CHECK_OUT_FEE	"Gebyr      50 kr"
-#define L_BALANCE				"Saldo %d kr"
-#define L_INSUFFICIENT_FUNDS	"Saldo for lav   "
-#define L_INVALID_CARD			"Ugyldigt kort   "
-#define L_OK					"OK              "
-#define L_SYSTEM_ERROR			"SYSTEMFEJL      "
-#define L_OUT_OF_ORDER			"Ude af drift    "
+#include <avr/pgmspace.h>
+
+extern const char L_STARTING[] PROGMEM;
+extern const char L_WORKING[] PROGMEM;
+extern const char L_SCAN_HERE[] PROGMEM;
+extern const char L_CHECK_IN[] PROGMEM;
+extern const char L_CHECK_OUT[] PROGMEM;
+extern const char L_CHECK_OUT_TOO_LATE[] PROGMEM;
+extern const char L_LATE_CHECK_OUT_FEE[] PROGMEM;
+extern const char L_BALANCE[] PROGMEM;
+extern const char L_INSUFFICIENT_FUNDS[] PROGMEM;
+extern const char L_INVALID_CARD[] PROGMEM;
+extern const char L_OK[] PROGMEM;
+extern const char L_SYSTEM_ERROR[] PROGMEM;
+extern const char L_CURRENCY[] PROGMEM;
+extern const char L_OUT_OF_ORDER[] PROGMEM;
 
 #endif
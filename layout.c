@@ -0,0 +1,446 @@
+/*--------------------------------------------------------
+
+layout.c
+
+This file contains the screen layout. A screen is made of
+named fields, such as the title and the balance, and each
+field has a position and a width given by the display
+geometry. The geometry is read from EEPROM, or chosen at
+build time from DISPLAY_COLUMNS and DISPLAY_ROWS when the
+EEPROM is erased.
+
+A screen is set up between Layout_Begin and Layout_End.
+Layout_End only renders the fields whose content changed
+since they were last drawn, and blanks the fields that are
+no longer used.
+
+Version: 	1
+Author: 	Jacob Pedersen
+Company:	IHK
+Date:		2012-12-01
+
+--------------------------------------------------------*/
+
+#include "config.h"
+#include <stdint.h>
+#include <string.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+
+#include "layout.h"
+#include "common.h"
+#include "lcd.h"
+#include "lang.h"
+
+/**
+ * Kinds of field content
+ */
+#define LAYOUT_DIRTY		0	// unknown, always redrawn
+#define LAYOUT_EMPTY		1
+#define LAYOUT_FLASH		2	// text in flash
+#define LAYOUT_AMOUNT		3	// label in flash and an amount
+#define LAYOUT_RAM			4	// text in RAM, always redrawn
+#define LAYOUT_MARQUEE		5	// text in RAM that may scroll, always redrawn
+
+/**
+ * Content of a field
+ */
+struct layout_content
+{
+	uint8_t kind;
+	const char * text;
+	uint16_t amount;
+};
+
+/**
+ * Geometry used when none is stored in EEPROM
+ */
+static const struct layout_geometry default_geometry PROGMEM =
+{
+	DISPLAY_COLUMNS, DISPLAY_ROWS,
+#if DISPLAY_ROWS >= 4
+	{
+		{ 0, 0, DISPLAY_COLUMNS },	// title
+		{ 0, 1, DISPLAY_COLUMNS },	// price
+		{ 0, 2, DISPLAY_COLUMNS },	// balance
+		{ 0, 3, DISPLAY_COLUMNS }	// footer
+	}
+#else
+	{
+		{ 0, 0, DISPLAY_COLUMNS },	// title
+		{ 0, 0, DISPLAY_COLUMNS },	// price, instead of the title
+		{ 0, 1, DISPLAY_COLUMNS },	// balance
+		{ 0, 1, DISPLAY_COLUMNS }	// footer, instead of the balance
+	}
+#endif
+};
+
+/**
+ * Geometry programmed into EEPROM. Erased (0xFF) or zero when not set.
+ */
+static struct layout_geometry EEMEM ee_geometry;
+
+/**
+ * Geometry in use
+ */
+static struct layout_geometry geometry;
+
+/**
+ * Content wanted by the screen being set up
+ */
+static struct layout_content wanted[LAYOUT_FIELDS];
+
+/**
+ * Content on the display
+ */
+static struct layout_content drawn[LAYOUT_FIELDS];
+
+/**
+ * @return Non-zero if the two fields share cells
+ */
+static uint8_t
+overlaps(uint8_t a, uint8_t b)
+{
+	const struct layout_field * fa = &geometry.fields[a];
+	const struct layout_field * fb = &geometry.fields[b];
+
+	return fa->width != 0 && fb->width != 0 && fa->y == fb->y
+		&& fa->x < fb->x + fb->width && fb->x < fa->x + fa->width;
+}
+
+/**
+ * The display shift moves every row, and rows 2 and 3 of a four
+ * row display share DDRAM with rows 0 and 1. So a field can only
+ * scroll on a display of up to two rows, when it takes a whole row 
+ * and no field on another row has content.
+ *
+ * @return Non-zero if the field can scroll
+ */
+static uint8_t
+canScroll(uint8_t field)
+{
+	const struct layout_field * f = &geometry.fields[field];
+	uint8_t j;
+
+	if (geometry.rows > 2 || f->x != 0 || f->width != geometry.columns)
+	{
+		return 0;
+	}
+
+	for (j = 0; j < LAYOUT_FIELDS; j++)
+	{
+		if (wanted[j].kind != LAYOUT_EMPTY && geometry.fields[j].width != 0
+			&& geometry.fields[j].y != f->y)
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Writes text at the cursor. Bytes starting a UTF-8 pair
+ * take no cell of their own.
+ *
+ * @param text The text
+ * @param flash Non-zero if the text is in flash
+ * @param width Cells available
+ * @return Cells written
+ */
+static uint8_t
+putText(const char * text, uint8_t flash, uint8_t width)
+{
+	uint8_t cells = 0;
+	char c;
+
+	for (;;)
+	{
+		c = flash ? pgm_read_byte(text) : *text;
+		// A lead byte is only sent when its pair fits, so no 
+		// half pair is left in the LCD driver
+		if (c == 0 || cells == width)
+		{
+			break;
+		}
+		if ((uint8_t)c != 0xC2 && (uint8_t)c != 0xC3)
+		{
+			cells++;
+		}
+		LCD_PutChar(c);
+		text++;
+	}
+
+	return cells;
+}
+
+/**
+ * @return Cells taken by an amount written by LCD_PutDecimal
+ */
+static uint8_t
+amountCells(uint16_t amount)
+{
+	uint8_t n = 0;
+
+	do
+	{
+		n++;
+		amount /= 10;
+	}
+	while (amount != 0 || n <= AMOUNT_DECIMALS);
+
+	return AMOUNT_DECIMALS ? n + 1 : n;
+}
+
+/**
+ * Draws the wanted content of a field, padded with spaces. An 
+ * amount that does not fit is shown as # signs.
+ *
+ * @param field The field
+ */
+static void
+render(uint8_t field)
+{
+	const struct layout_field * f = &geometry.fields[field];
+	const struct layout_content * c = &wanted[field];
+	uint8_t cells = 0;
+	uint8_t unit, room;
+
+	LCD_GotoXY(f->x, f->y);
+
+	if (c->kind == LAYOUT_MARQUEE && canScroll(field))
+	{
+		LCD_Marquee(c->text, f->y, LAYOUT_MARQUEE_MS);
+		return;
+	}
+
+	if (c->kind == LAYOUT_FLASH || c->kind == LAYOUT_RAM || c->kind == LAYOUT_MARQUEE)
+	{
+		cells = putText(c->text, c->kind == LAYOUT_FLASH, f->width);
+	}
+	else if (c->kind == LAYOUT_AMOUNT)
+	{
+		cells = putText(c->text, 1, f->width);
+		unit = strlen_P(L_CURRENCY);
+		if (cells + unit < f->width)
+		{
+			room = f->width - cells - unit;
+			if (amountCells(c->amount) <= room)
+			{
+				LCD_PutDecimal(c->amount, AMOUNT_DECIMALS, room);
+			}
+			else
+			{
+				for (; room > 0; room--)
+				{
+					LCD_PutChar('#');
+				}
+			}
+			putText(L_CURRENCY, 1, unit);
+			cells = f->width;
+		}
+	}
+
+	for (; cells < f->width; cells++)
+	{
+		LCD_PutChar(' ');
+	}
+}
+
+/**
+ * Reads the geometry and initializes the display for it.
+ */
+void
+Layout_Init(void)
+{
+	uint8_t i;
+	struct layout_field * f;
+
+	eeprom_read_block(&geometry, &ee_geometry, sizeof(geometry));
+	if (geometry.columns == 0xFF || geometry.columns == 0)
+	{
+		memcpy_P(&geometry, &default_geometry, sizeof(geometry));
+	}
+
+	if (geometry.columns > LCD_MAX_COLUMNS)
+	{
+		geometry.columns = LCD_MAX_COLUMNS;
+	}
+	if (geometry.rows > LCD_MAX_ROWS)
+	{
+		geometry.rows = LCD_MAX_ROWS;
+	}
+
+	// Keep the fields on the display
+	for (i = 0; i < LAYOUT_FIELDS; i++)
+	{
+		f = &geometry.fields[i];
+		if (f->y >= geometry.rows || f->x >= geometry.columns)
+		{
+			f->width = 0;
+		}
+		else if (f->width > geometry.columns - f->x)
+		{
+			f->width = geometry.columns - f->x;
+		}
+
+		drawn[i].kind = LAYOUT_EMPTY;
+	}
+
+	LCD_Init(geometry.columns, geometry.rows);
+	LCD_Clear();
+}
+
+/**
+ * Stores a new geometry in EEPROM and starts using it. The 
+ * display is cleared.
+ *
+ * @param g The geometry
+ * @return Non-zero if the geometry was valid and stored
+ */
+uint8_t
+Layout_SetGeometry(const struct layout_geometry * g)
+{
+	if (g->columns == 0 || g->columns > LCD_MAX_COLUMNS
+		|| g->rows == 0 || g->rows > LCD_MAX_ROWS)
+	{
+		return 0;
+	}
+
+	eeprom_update_block(g, &ee_geometry, sizeof(ee_geometry));
+	Layout_Init();
+
+	return 1;
+}
+
+/**
+ * Starts a new screen. Fields not set before Layout_End
+ * are blanked.
+ */
+void
+Layout_Begin(void)
+{
+	uint8_t i;
+
+	memset(wanted, 0, sizeof(wanted));
+	for (i = 0; i < LAYOUT_FIELDS; i++)
+	{
+		wanted[i].kind = LAYOUT_EMPTY;
+	}
+}
+
+/**
+ * Sets a field to a text in flash.
+ *
+ * @param field The field
+ * @param text The text, in flash
+ */
+void
+Layout_SetText_P(uint8_t field, PGM_P text)
+{
+	wanted[field].kind = LAYOUT_FLASH;
+	wanted[field].text = text;
+}
+
+/**
+ * Sets a field to a text in RAM. The text must stay valid
+ * until Layout_End, and is always redrawn.
+ *
+ * @param field The field
+ * @param text The text
+ */
+void
+Layout_SetText(uint8_t field, const char * text)
+{
+	wanted[field].kind = LAYOUT_RAM;
+	wanted[field].text = text;
+}
+
+/**
+ * Sets a field to a text in RAM of up to 40 characters, which
+ * scrolls when it is longer than the field and the field can
+ * scroll. Otherwise it is cut like any other text. The text must
+ * stay valid until Layout_End, and is always redrawn.
+ *
+ * @param field The field
+ * @param text The text
+ */
+void
+Layout_SetMarquee(uint8_t field, const char * text)
+{
+	wanted[field].kind = LAYOUT_MARQUEE;
+	wanted[field].text = text;
+}
+
+/**
+ * Sets a field to a label followed by an amount right-aligned
+ * in the field, like "Saldo      150 kr".
+ *
+ * @param field The field
+ * @param label The label, in flash
+ * @param amount The amount in the smallest unit sent by the server
+ */
+void
+Layout_SetAmount_P(uint8_t field, PGM_P label, uint16_t amount)
+{
+	wanted[field].kind = LAYOUT_AMOUNT;
+	wanted[field].text = label;
+	wanted[field].amount = amount;
+}
+
+/**
+ * Draws the screen. A field is drawn when its content differs
+ * from what is on the display. A field that shares cells with a
+ * used field of a higher number, or an empty field sharing cells
+ * with any used field, is not drawn. A running marquee is 
+ * stopped, and started again if the field still scrolls.
+ */
+void
+Layout_End(void)
+{
+	uint8_t i, j, hidden;
+
+	LCD_MarqueeStop();
+
+	for (i = 0; i < LAYOUT_FIELDS; i++)
+	{
+		if (geometry.fields[i].width == 0)
+		{
+			continue;
+		}
+
+		hidden = 0;
+		for (j = 0; j < LAYOUT_FIELDS; j++)
+		{
+			if (j != i && wanted[j].kind != LAYOUT_EMPTY && overlaps(i, j)
+				&& (j > i || wanted[i].kind == LAYOUT_EMPTY))
+			{
+				hidden = 1;
+			}
+		}
+
+		if (hidden)
+		{
+			drawn[i].kind = LAYOUT_DIRTY;
+			continue;
+		}
+
+		if (wanted[i].kind != LAYOUT_RAM && wanted[i].kind != LAYOUT_MARQUEE
+			&& wanted[i].kind == drawn[i].kind
+			&& wanted[i].text == drawn[i].text && wanted[i].amount == drawn[i].amount)
+		{
+			continue;
+		}
+
+		render(i);
+		drawn[i] = wanted[i];
+
+		for (j = 0; j < LAYOUT_FIELDS; j++)
+		{
+			if (j != i && overlaps(i, j))
+			{
+				drawn[j].kind = LAYOUT_DIRTY;
+			}
+		}
+	}
+}
@@ -0,0 +1,66 @@
+#ifndef _LAYOUT_H_
+#define _LAYOUT_H_
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+/**
+ * Fields of a screen. When two fields share cells, the one
+ * with the highest number is shown.
+ */
+#define LAYOUT_TITLE		0
+#define LAYOUT_PRICE		1
+#define LAYOUT_BALANCE		2
+#define LAYOUT_FOOTER		3
+#define LAYOUT_FIELDS		4
+
+/**
+ * Position of a field on the display. A width of 0 hides it.
+ */
+struct layout_field
+{
+	uint8_t x;
+	uint8_t y;
+	uint8_t width;
+};
+
+/**
+ * Display size and the position of each field
+ */
+struct layout_geometry
+{
+	uint8_t columns;
+	uint8_t rows;
+	struct layout_field fields[LAYOUT_FIELDS];
+};
+
+/**
+ * Time in ms between two steps of a scrolling field
+ */
+#define LAYOUT_MARQUEE_MS	300
+
+void 
+Layout_Init(void);
+
+uint8_t 
+Layout_SetGeometry(const struct layout_geometry * g);
+
+void 
+Layout_Begin(void);
+
+void 
+Layout_SetText_P(uint8_t field, PGM_P text);
+
+void 
+Layout_SetText(uint8_t field, const char * text);
+
+void 
+Layout_SetMarquee(uint8_t field, const char * text);
+
+void 
+Layout_SetAmount_P(uint8_t field, PGM_P label, uint16_t amount);
+
+void 
+Layout_End(void);
+
+#endif
@@ -7,10 +7,36 @@
 // Connect LCD display to the ports and pins defined in lcd.h          //
 // Call LCDInit() first with the number of columns on the display.     //
 //                                                                     //
-// This version has no handshaking. You may connect LCD_RD to ground   //
+// Handshaking is optional. With LCD_HANDSHAKE 0 you may connect       //
+// LCD_RD to ground. With LCD_HANDSHAKE 1 the busy flag is read back   //
+// and fixed delays are only used if the display never shows it.      //
+//                                                                     //
+// A RAM shadow of the display is kept. Characters equal to what the   //
+// display already shows are skipped, and the address is only set     //
+// when the next changed cell is not where the controller points.      //
+//                                                                     //
+// After LCD_Init, commands and characters are put in a queue which    //
+// LCD_OnTick drains one nibble per call. Call it from a timer         //
+// interrupt at about 1 kHz. The output functions return at once.      //
+//                                                                     //
+// Characters missing from the display ROM (Danish letters and a few   //
+// icons) are drawn with the eight CGRAM glyphs. Text may be UTF-8 or  //
+// Latin-1. A glyph is only uploaded when it is not already in CGRAM,  //
+// and a slot is only reused when no cell on the display shows it.     //
+//                                                                     //
+// A line longer than the display can scroll as a marquee. It is       //
+// written once into the 40 character DDRAM line, and LCD_OnTick       //
+// sends one display shift instruction per step. The shift moves all  //
+// lines, so keep the other lines blank while a marquee runs. On four  //
+// row displays rows 2 and 3 are the back halves of the DDRAM lines,   //
+// so there is no room for a marquee and the text is just written.     //
 //                                                                     //
 /////////////////////////////////////////////////////////////////////////
 
+#include "config.h"
+#include <string.h>
+#include <util/delay.h>
+#include <util/atomic.h>
 #include "lcd.h"
 
 
@@ -18,35 +44,86 @@
 //                       Local variables                               //
 /////////////////////////////////////////////////////////////////////////
 static unsigned char LCD_base_y[4] = {0x80, 0xC0, 0, 0};
-static unsigned char LCD_x, LCD_y, LCD_maxx;
+static unsigned char LCD_x, LCD_y, LCD_maxx, LCD_maxy;
+
+// What the display shows
+static char LCD_shadow[LCD_MAX_ROWS][LCD_MAX_COLUMNS];
+
+// Where the controller's address counter points
+static unsigned char LCD_hw_x, LCD_hw_y;
+
+// Output queue. Bytes in LCD_queue, and one bit per entry in LCD_queue_rs
+// that is set for data and clear for commands. Clear and home are the
+// only commands below 4, and are followed by LCD_SLOW_TICKS of waiting.
+// Sized for a full redraw of a 20x4 display, 80 characters and 4
+// addresses, so LCD_queue_put does not wait for LCD_OnTick
+#define LCD_QUEUE_SIZE 128        // must be a power of two
+#define LCD_Q_DATA     1          // RS=1, else command
+#define LCD_Q_IS_DATA(i) (LCD_queue_rs[(i) >> 3] & (1 << ((i) & 7)))
+#define LCD_Q_IS_SLOW(i) (!LCD_Q_IS_DATA(i) && LCD_queue[i] < 4)
+#define LCD_SLOW_TICKS (LCD_CLEAR_US / 1000 + 1) // ticks of 1 ms
+static unsigned char LCD_queue[LCD_QUEUE_SIZE];
+static unsigned char LCD_queue_rs[LCD_QUEUE_SIZE / 8];
+static volatile unsigned char LCD_head;     // written by LCD_queue_put only
+static volatile unsigned char LCD_tail;     // written by LCD_OnTick only
+static volatile unsigned char LCD_low_nibble; // next nibble is the low one
+static volatile unsigned char LCD_halted;   // LCD_OnTick does nothing
+static unsigned char LCD_wait;              // ticks to wait before next nibble
+
+// Glyphs that can be loaded into CGRAM: Latin-1 code, character shown
+// when all slots are in use, and 8 rows of 5 pixels
+#define LCD_GLYPH_SLOTS 8
+static const unsigned char LCD_glyphs[][10] PROGMEM = {
+   {0xE6, 'a', 0x00, 0x00, 0x1A, 0x05, 0x0F, 0x14, 0x1B, 0x00},  // ae
+   {0xF8, 'o', 0x00, 0x00, 0x0E, 0x13, 0x15, 0x19, 0x0E, 0x00},  // o slash
+   {0xE5, 'a', 0x04, 0x0A, 0x04, 0x0E, 0x01, 0x0F, 0x11, 0x0F},  // a ring
+   {0xC6, 'A', 0x0F, 0x14, 0x14, 0x1E, 0x14, 0x14, 0x17, 0x00},  // AE
+   {0xD8, 'O', 0x0E, 0x13, 0x15, 0x15, 0x15, 0x19, 0x0E, 0x00},  // O slash
+   {0xC5, 'A', 0x04, 0x0A, 0x04, 0x0E, 0x11, 0x1F, 0x11, 0x00},  // A ring
+   {0x80, '*', 0x00, 0x01, 0x03, 0x16, 0x1C, 0x08, 0x00, 0x00},  // LCD_ICON_OK
+   {0x81, '!', 0x00, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x00, 0x00},  // LCD_ICON_ERROR
+   {0x82, '#', 0x00, 0x1F, 0x1F, 0x11, 0x11, 0x1F, 0x00, 0x00},  // LCD_ICON_CARD
+};
+#define LCD_GLYPH_COUNT (sizeof(LCD_glyphs) / sizeof(LCD_glyphs[0]))
+static unsigned char LCD_cgram[LCD_GLYPH_SLOTS]; // code in each slot, 0 = free
+static unsigned char LCD_utf8_lead;         // first byte of a UTF-8 pair
+
+// Marquee. LCD_OnTick shifts the display left every LCD_marquee_step
+// ticks, between two queued bytes
+#define LCD_LINE_LENGTH 40        // DDRAM per line in two line mode
+static volatile unsigned int LCD_marquee_step;   // 0 = no marquee
+static unsigned int LCD_marquee_ticks;           // used by LCD_OnTick only
+
+#if LCD_HANDSHAKE
+#define LCD_BURST      8          // bytes per tick in busy flag mode
+#define LCD_BUSY_POLLS 20         // busy flag reads before giving up the tick
+static unsigned char LCD_busy_mode;         // busy flag found by LCD_Init
+#endif
 
 
 /////////////////////////////////////////////////////////////////////////
 //                    Functions used internally                        //
 /////////////////////////////////////////////////////////////////////////
 
-// Delay. Circa 200 us at 10 MHz
-// The data sheet says that 40 us is sufficient, but the displays we have
-// require more than 100 us to work properly.
-void LCD_delay(void) __attribute__ ((noinline)); // noinline prevents problems when optimizing with option -O3
+// Delay for the execution time of most instructions.
+// Cycle exact from F_CPU and the LCD_*_US timings in lcd.h
 void LCD_delay(void)  {
-   __asm__ __volatile__("ldi r31,65 \n 1:\n dec r31 \n brne 1b" ::: "r31");
+   _delay_us(LCD_EXEC_US);
 }
 
-// Long delay. Circa 26 ms at 10 MHz
-void LCD_long_delay(void) __attribute__ ((noinline));
+// Long delay for the execution time of clear and home
 void LCD_long_delay(void) {
-   __asm__ __volatile__("clr r26 \n clr r27 \n 2:\n sbiw r26,1\n brne 2b \n" ::: "r26", "r27");
+   _delay_us(LCD_CLEAR_US);
 }
 
-// Write 4 bits
+// Write 4 bits. Enable is high and low for at least LCD_PULSE_US
 static void LCD_write_nibble(char data) {
    const char DataMask = 0x0F << LCD_DATA4;
    LCD_PORT = (LCD_PORT & ~DataMask) | (data & DataMask);
    LCD_PORT |= (1<<LCD_ENABLE); // EN=1
-   LCD_delay();
+   _delay_us(LCD_PULSE_US);
    LCD_PORT &= ~(1<<LCD_ENABLE); // EN=0
-   LCD_delay();
+   _delay_us(LCD_PULSE_US);
 }
 
 // Write 8 bits. RS = 0 or 1
@@ -55,14 +132,158 @@ static void LCD_write_data(unsigned char data) {
    LCD_write_nibble(data << 4);       // write LSN
 }
 
-// Write a byte to the LCD character generator or display RAM
-void LCD_write_byte(unsigned char addr, unsigned char data) {
-   LCD_delay();
-   LCD_PORT &= ~(1<<LCD_RS);       // RS=0
-   LCD_write_data(addr);
-   LCD_delay();
-   LCD_PORT |= (1<<LCD_RS);        // RS=1
-   LCD_write_data(data);
+// Count a tick of the marquee. Returns 1 when it is time for a shift
+static unsigned char LCD_marquee_due(void) {
+   if (LCD_marquee_step == 0) return 0;
+   if (LCD_marquee_ticks < LCD_marquee_step) ++LCD_marquee_ticks;
+   return LCD_marquee_ticks >= LCD_marquee_step;
+}
+
+// Shift the display one position left. Must not split a queued byte
+static void LCD_shift_left(void) {
+   LCD_PORT &= ~(1<<LCD_RS);          // RS=0
+   LCD_write_data(0x18);              // shift display left
+   LCD_marquee_ticks = 0;
+}
+
+#if LCD_HANDSHAKE
+// Read the busy flag. The data pins are pulled up while reading, so a
+// display that does not drive them reads as busy.
+static unsigned char LCD_read_busy(void) {
+   const char DataMask = 0x0F << LCD_DATA4;
+   unsigned char busy;
+   LCD_DIRECTION &= ~DataMask;   // data pins as input
+   LCD_PORT |= DataMask;         // with pull-ups
+   LCD_PORT &= ~(1<<LCD_RS);     // RS=0
+   LCD_PORT |= (1<<LCD_RD);      // RD=1
+   LCD_PORT |= (1<<LCD_ENABLE);  // EN=1, read MSN
+   _delay_us(LCD_PULSE_US);
+   busy = LCD_PIN & (1 << (LCD_DATA4 + 3)); // busy flag is D7
+   LCD_PORT &= ~(1<<LCD_ENABLE); // EN=0
+   _delay_us(LCD_PULSE_US);
+   LCD_PORT |= (1<<LCD_ENABLE);  // EN=1, read LSN, not used
+   _delay_us(LCD_PULSE_US);
+   LCD_PORT &= ~(1<<LCD_ENABLE); // EN=0
+   LCD_PORT &= ~(1<<LCD_RD);     // RD=0
+   LCD_PORT &= ~DataMask;
+   LCD_DIRECTION |= DataMask;    // data pins as output
+   return busy;
+}
+
+// Send queued bytes while the display is ready, up to LCD_BURST per tick
+static void LCD_send_burst(void) {
+   unsigned char n, polls;
+   if (LCD_marquee_due()) {
+      for (polls = 0; LCD_read_busy(); polls++) {
+         if (polls == LCD_BUSY_POLLS) return; // try again next tick
+      }
+      LCD_shift_left();
+   }
+   for (n = 0; n < LCD_BURST && LCD_tail != LCD_head; n++) {
+      for (polls = 0; LCD_read_busy(); polls++) {
+         if (polls == LCD_BUSY_POLLS) return; // try again next tick
+      }
+      if (LCD_Q_IS_DATA(LCD_tail)) LCD_PORT |= (1<<LCD_RS);  // RS = 1
+      LCD_write_nibble(LCD_queue[LCD_tail]);          // write MSN
+      LCD_write_nibble(LCD_queue[LCD_tail] << 4);     // write LSN
+      LCD_tail = (LCD_tail + 1) & (LCD_QUEUE_SIZE - 1);
+   }
+}
+#endif
+
+// Wait until everything queued has been sent, and the display is not
+// left between the two nibbles of a byte
+static void LCD_drain(void) {
+   while (LCD_tail != LCD_head || LCD_low_nibble) {
+      if (!(SREG & (1<<SREG_I))) {
+         _delay_ms(1);
+         LCD_OnTick();
+      }
+   }
+}
+
+// Put a byte in the output queue. Waits while the queue is full.
+// With interrupts off the queue is drained from here instead.
+static void LCD_queue_put(unsigned char data, unsigned char flags) {
+   unsigned char next = (LCD_head + 1) & (LCD_QUEUE_SIZE - 1);
+   while (next == LCD_tail) {
+      if (!(SREG & (1<<SREG_I))) {
+         _delay_ms(1);
+         LCD_OnTick();
+      }
+   }
+   LCD_queue[LCD_head] = data;
+   if (flags & LCD_Q_DATA) LCD_queue_rs[LCD_head >> 3] |= 1 << (LCD_head & 7);
+   else LCD_queue_rs[LCD_head >> 3] &= ~(1 << (LCD_head & 7));
+   LCD_head = next;
+}
+
+// Clear the display with the clear instruction. Slow, used by LCD_Init
+static void LCD_hw_clear(void) {
+   LCD_queue_put(2, 0);               // cursor home
+   LCD_queue_put(0xC, 0);             // cursor off
+   LCD_queue_put(1, 0);               // clear
+   memset(LCD_shadow, ' ', sizeof(LCD_shadow));
+   memset(LCD_cgram, 0, sizeof(LCD_cgram)); // CGRAM is undefined at power on
+   LCD_x = LCD_y = 0;
+   LCD_hw_x = LCD_hw_y = 0;
+}
+
+// Find the display code for a Latin-1 character above 0x7F. A glyph
+// that is not in CGRAM is uploaded to a free slot, or to a slot that
+// no cell on the display shows. Codes 8 - 15 are used for the slots,
+// as they show the same glyphs as 0 - 7 and are never a terminator
+static unsigned char LCD_glyph(unsigned char code) {
+   unsigned char i, slot, row;
+   for (i = 0; i < LCD_GLYPH_COUNT; i++) {
+      if (pgm_read_byte(&LCD_glyphs[i][0]) == code) break;
+   }
+   if (i == LCD_GLYPH_COUNT) return code;   // no glyph. let the ROM show it
+   for (slot = 0; slot < LCD_GLYPH_SLOTS; slot++) {
+      if (LCD_cgram[slot] == code) return 8 + slot;   // already loaded
+   }
+   for (slot = 0; slot < LCD_GLYPH_SLOTS && LCD_cgram[slot] != 0; slot++);
+   if (slot == LCD_GLYPH_SLOTS) {
+      for (slot = 0; slot < LCD_GLYPH_SLOTS; slot++) {
+         if (!memchr(LCD_shadow, 8 + slot, sizeof(LCD_shadow))) break;
+      }
+      if (slot == LCD_GLYPH_SLOTS) return pgm_read_byte(&LCD_glyphs[i][1]);
+   }
+   LCD_queue_put(0x40 | (slot << 3), 0);    // set CGRAM address
+   for (row = 0; row < 8; row++) {
+      LCD_queue_put(pgm_read_byte(&LCD_glyphs[i][2 + row]), LCD_Q_DATA);
+   }
+   LCD_cgram[slot] = code;
+   LCD_hw_x = 0xFF;                         // address counter is in CGRAM
+   return 8 + slot;
+}
+
+// Write a Latin-1 character through the shadow
+static void LCD_put_code(unsigned char c) {
+   if (c == '\n') {
+      // newline character goes to next line
+      ++LCD_y;
+      LCD_x = 0;
+      return;
+   }
+   if (LCD_x >= LCD_maxx) {
+      // end of line. go to next line
+      ++LCD_y;
+      LCD_x = 0;
+   }
+   if (LCD_y >= LCD_MAX_ROWS) return; // below the last line
+   if (c & 0x80) c = LCD_glyph(c);
+   if ((unsigned char)LCD_shadow[LCD_y][LCD_x] != c) {
+      if (LCD_hw_x != LCD_x || LCD_hw_y != LCD_y) {
+         // controller points elsewhere. set address
+         LCD_queue_put(LCD_base_y[LCD_y]+LCD_x, 0);
+      }
+      LCD_queue_put(c, LCD_Q_DATA);
+      LCD_shadow[LCD_y][LCD_x] = c;
+      LCD_hw_x = LCD_x + 1;     // address counter increments
+      LCD_hw_y = LCD_y;
+   }
+   ++LCD_x;
 }
 
 /////////////////////////////////////////////////////////////////////////
@@ -71,58 +292,71 @@ void LCD_write_byte(unsigned char addr, unsigned char data) {
 //                                                                     //
 /////////////////////////////////////////////////////////////////////////
 
-// Initialize the LCD controller. Specify the number of columns
-void LCD_Init(unsigned char lcd_columns) {
+// Initialize the LCD controller. Specify the number of columns and rows
+void LCD_Init(unsigned char lcd_columns, unsigned char lcd_rows) {
+   if (lcd_columns > LCD_MAX_COLUMNS) lcd_columns = LCD_MAX_COLUMNS;
+   if (lcd_rows > LCD_MAX_ROWS) lcd_rows = LCD_MAX_ROWS;
+   // May be called again at run time. Finish queued output, then keep
+   // LCD_OnTick off the port while the controller is set up
+   ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      LCD_marquee_step = 0;
+   }
+   LCD_drain();
+   LCD_halted = 1;
+   LCD_wait = 0;
+   LCD_marquee_ticks = 0;
    LCD_PORT &= ~((1<<LCD_ENABLE) | (1<<LCD_RS)); // EN=0, RS=0
    LCD_PORT &= ~(1<<LCD_RD); // Set RD = 0 in case it is connected
    LCD_DIRECTION |= (0xF << LCD_DATA4) | (1<<LCD_RS) | (1<<LCD_ENABLE) ; // set all as output
    //LCD_DIRECTION |= (1<<LCD_RD); // set RD as output if it is connected
    LCD_maxx = lcd_columns;
+   LCD_maxy = lcd_rows;
    LCD_base_y[2] = lcd_columns+0x80;
    LCD_base_y[3] = lcd_columns+0xc0;
-   LCD_long_delay();
+   _delay_us(LCD_POWER_ON_US);
    LCD_write_nibble(0x30);
-   LCD_long_delay();
+   _delay_us(LCD_INIT_US);
    LCD_write_nibble(0x30);
-   LCD_long_delay();
+   _delay_us(LCD_INIT_SHORT_US);
    LCD_write_nibble(0x30);
-   LCD_long_delay();
+   LCD_delay();
    LCD_write_nibble(0x20);
-   LCD_long_delay();
+   LCD_delay();
    LCD_write_data(0x28);
-   LCD_long_delay();
+   LCD_delay();
    LCD_write_data(4);
-   LCD_long_delay();
+   LCD_delay();
    LCD_write_data(0x85);
-   LCD_long_delay();
+   LCD_delay();
    LCD_PORT &= ~(1<<LCD_RS);
    LCD_write_data(6);
+   LCD_delay();
+#if LCD_HANDSHAKE
+   // The display must be busy right after a clear, and ready later
+   LCD_DIRECTION |= (1<<LCD_RD); // set RD as output
+   LCD_write_data(1);
+   LCD_busy_mode = LCD_read_busy() != 0;
+   LCD_long_delay();
    LCD_long_delay();
-   LCD_Clear();
+   LCD_busy_mode = LCD_busy_mode && !LCD_read_busy();
+#endif
+   LCD_hw_clear();
+   LCD_halted = 0;
 }
 
-// Clear the LCD display
+// Clear the LCD display. Only cells that are not blank are written
 void LCD_Clear(void) {
-   LCD_long_delay();
-   LCD_PORT &= ~(1<<LCD_RS);          // RS=0
-   LCD_write_data(2);                 // cursor home
-   LCD_long_delay();
-   LCD_write_data(0xC);               // cursor off
-   LCD_long_delay();
-   LCD_write_data(1);                 // clear
-   LCD_long_delay();
+   unsigned char y;
+   LCD_MarqueeStop();
+   for (y = 0; y < LCD_MAX_ROWS; y++) LCD_PutLine("", y);
    LCD_x = LCD_y = 0;
 }
 
-// Set the LCD display position
+// Set the LCD display position. The address is sent with the next
+// character that changes the display.
 void LCD_GotoXY(unsigned char x, unsigned char y) {
-   LCD_delay();
-   LCD_PORT &= ~(1<<LCD_RS);       // RS=0
-   LCD_write_data(LCD_base_y[y]+x);
    LCD_x = x;
    LCD_y = y;
-   LCD_delay();
-   //LCD_long_delay();
 }
 
 // write a zero-terminated ASCII string to the display
@@ -131,24 +365,167 @@ void LCD_PutString(const char *str) {
    for (; (c = *str) != 0; str++) LCD_PutChar(c);
 }
 
-// write a single ASCII character to the display
+// write a string on a line and fill the rest of the line with spaces
+void LCD_PutLine(const char *str, unsigned char y) {
+   LCD_GotoXY(0, y);
+   for (; *str != 0 && LCD_x < LCD_maxx; str++) LCD_PutChar(*str);
+   while (LCD_x < LCD_maxx) LCD_PutChar(' ');
+}
+
+// write a zero-terminated ASCII string stored in flash to the display
+void LCD_PutString_P(PGM_P str) {
+   char c;
+   for (; (c = pgm_read_byte(str)) != 0; str++) LCD_PutChar(c);
+}
+
+// write a string stored in flash on a line and fill the rest of the
+// line with spaces
+void LCD_PutLine_P(PGM_P str, unsigned char y) {
+   char c;
+   LCD_GotoXY(0, y);
+   for (; (c = pgm_read_byte(str)) != 0 && LCD_x < LCD_maxx; str++) LCD_PutChar(c);
+   while (LCD_x < LCD_maxx) LCD_PutChar(' ');
+}
+
+// write a number right-aligned at the cursor. The digits are made
+// from the right into a small buffer and written through the shadow,
+// so an unchanged amount costs no display traffic. Values that fit in
+// 16 bits are divided with 16 bit arithmetic, which is much faster
+void LCD_PutDecimal(long value, unsigned char decimals, unsigned char width) {
+   char digits[12];                        // sign, 10 digits and the mark
+   unsigned long v = value < 0 ? -(unsigned long)value : (unsigned long)value;
+   unsigned char n = 0, d = 0;
+   unsigned int w;
+   do {
+      if (decimals != 0 && d == decimals) digits[n++] = LCD_DECIMAL_MARK;
+      if (v > 0xFFFF) {
+         digits[n++] = '0' + (char)(v % 10);
+         v /= 10;
+      }
+      else {
+         w = (unsigned int)v;
+         digits[n++] = '0' + (char)(w % 10);
+         v = w / 10;
+      }
+      d++;
+   } while (v != 0 || d <= decimals);
+   if (value < 0) digits[n++] = '-';
+   for (; width > n; width--) LCD_PutChar(' ');
+   while (n != 0) LCD_PutChar(digits[--n]);
+}
+
+// Scroll a line that is longer than the display. The text, up to 40
+// characters, is written once into the DDRAM line, and the display is
+// shifted one position every step_ms ticks. A text that fits, or any
+// text when more than two rows are used, is just written as a line.
+// The shadow keeps the first LCD_maxx characters, which is what the
+// line shows again after LCD_MarqueeStop. UTF-8 pairs are taken as
+// by LCD_PutChar
+static void LCD_marquee(const char *str, unsigned char flash, unsigned char y, unsigned int step_ms) {
+   unsigned char x, c, n, cells = 0;
+   const char *p;
+   LCD_MarqueeStop();
+   for (p = str; (c = flash ? pgm_read_byte(p) : *p) != 0; p++) {
+      if (c != 0xC2 && c != 0xC3) cells++;  // a lead byte takes no cell
+   }
+   if (cells <= LCD_maxx || y > 1 || LCD_maxy > 2) {
+      if (flash) LCD_PutLine_P(str, y);
+      else LCD_PutLine(str, y);
+      return;
+   }
+   LCD_queue_put(LCD_base_y[y], 0);          // start of the DDRAM line
+   for (x = 0; x < LCD_LINE_LENGTH; x++) {
+      c = flash ? pgm_read_byte(str) : *str;
+      if (c) str++;
+      else c = ' ';
+      if (c == 0xC2 || c == 0xC3) {
+         n = flash ? pgm_read_byte(str) : *str;
+         if ((n & 0xC0) == 0x80) {             // complete the pair
+            c = ((c & 3) << 6) | (n & 0x3F);
+            str++;
+         }
+      }
+      if (c & 0x80) c = LCD_glyph(c);
+      LCD_queue_put(c, LCD_Q_DATA);
+      if (x < LCD_maxx) LCD_shadow[y][x] = c;
+   }
+   LCD_hw_x = 0xFF;                          // address counter is past the shadow
+   ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      LCD_marquee_ticks = 0;
+      LCD_marquee_step = step_ms;
+   }
+}
+
+void LCD_Marquee(const char *str, unsigned char y, unsigned int step_ms) {
+   LCD_marquee(str, 0, y, step_ms);
+}
+
+void LCD_Marquee_P(PGM_P str, unsigned char y, unsigned int step_ms) {
+   LCD_marquee(str, 1, y, step_ms);
+}
+
+// Stop the marquee and shift the display back to the start
+void LCD_MarqueeStop(void) {
+   if (LCD_marquee_step == 0) return;
+   ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      LCD_marquee_step = 0;
+   }
+   LCD_queue_put(2, 0);                      // cursor home, undoes the shift
+   LCD_hw_x = LCD_hw_y = 0;
+}
+
+// write a single character to the display. UTF-8 pairs starting with
+// 0xC2 or 0xC3 are turned into Latin-1, other bytes are taken as Latin-1
 void LCD_PutChar(char c) {
-   if (c == '\n') {
-      // newline character goes to next line
-      ++LCD_y;
-      LCD_GotoXY(0,LCD_y);
-   }
-   else {
-      // any other character
-      ++LCD_x;
-      if (LCD_x>LCD_maxx) {
-         // end of line. go to next line
-         ++LCD_y;
-         LCD_GotoXY(0,LCD_y);
+   unsigned char u = c;
+   if (LCD_utf8_lead) {
+      if ((u & 0xC0) == 0x80) {
+         // continuation byte. complete the pair
+         u = ((LCD_utf8_lead & 3) << 6) | (u & 0x3F);
+         LCD_utf8_lead = 0;
+         LCD_put_code(u);
+         return;
       }
-      LCD_delay();
-      LCD_PORT |= (1<<LCD_RS);  // RS = 1
-      LCD_write_data(c);
-      LCD_delay();
+      // not UTF-8 after all. the lead byte was Latin-1
+      LCD_put_code(LCD_utf8_lead);
+      LCD_utf8_lead = 0;
+   }
+   if (u == 0xC2 || u == 0xC3) {
+      LCD_utf8_lead = u;
+      return;
+   }
+   LCD_put_code(u);
+}
+
+// Send the next nibble from the output queue. Call at about 1 kHz
+void LCD_OnTick(void) {
+   unsigned char shift;
+   if (LCD_halted) return;              // LCD_Init is running
+#if LCD_HANDSHAKE
+   if (LCD_busy_mode) {
+      LCD_send_burst();
+      return;
+   }
+#endif
+   shift = LCD_marquee_due();
+   if (LCD_wait) {
+      --LCD_wait;
+      return;
+   }
+   if (shift && !LCD_low_nibble) {
+      LCD_shift_left();                  // whole instruction in one tick
+      return;
+   }
+   if (LCD_tail == LCD_head) return; // queue empty
+   if (LCD_Q_IS_DATA(LCD_tail)) LCD_PORT |= (1<<LCD_RS);  // RS = 1
+   else LCD_PORT &= ~(1<<LCD_RS);                     // RS = 0
+   if (!LCD_low_nibble) {
+      LCD_write_nibble(LCD_queue[LCD_tail]);          // write MSN
+      LCD_low_nibble = 1;
+      return;
    }
+   LCD_write_nibble(LCD_queue[LCD_tail] << 4);        // write LSN
+   LCD_low_nibble = 0;
+   if (LCD_Q_IS_SLOW(LCD_tail)) LCD_wait = LCD_SLOW_TICKS;
+   LCD_tail = (LCD_tail + 1) & (LCD_QUEUE_SIZE - 1);
 }
@@ -5,6 +5,7 @@
 // Call lcd_init() first with the number of columns on the display.
 
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 
 //////////////////////////////////////////////////////////////////////
 //
@@ -15,6 +16,7 @@
 // Define which port the LCD display is connected to:
 #define  LCD_PORT       PORTA
 #define  LCD_DIRECTION  DDRA
+#define  LCD_PIN        PINA
 
 // Define control and data connections
 #define  LCD_RD     1             // RD connected to bit 1 on port
@@ -22,6 +24,45 @@
 #define  LCD_ENABLE 3             // EN connected to bit 3 on port
 #define  LCD_DATA4  4             // D4 - D7 connected to bit 4 - 7 on port
 
+// Set to 1 if LCD_RD is connected to the display's R/W pin. The busy
+// flag is then used instead of fixed delays, if the display has one.
+// Leave at 0 if LCD_RD is connected to ground.
+#define  LCD_HANDSHAKE  0
+
+// Timing in microseconds. The minimums from the HD44780 data sheet,
+// turned into cycle exact delays from F_CPU at compile time.
+// Define larger values with -D for slower displays.
+#ifndef LCD_PULSE_US
+#define  LCD_PULSE_US       1      // enable high or low, min 0.45 / 0.5 us
+#endif
+// The data sheet says 37 us is enough for most instructions, but the
+// displays we have require more than 100 us to work properly. It is
+// only waited for by LCD_Init, as queued output is sent one nibble
+// per tick.
+#ifndef LCD_EXEC_US
+#define  LCD_EXEC_US        120    // most instructions
+#endif
+#ifndef LCD_CLEAR_US
+#define  LCD_CLEAR_US       1520   // clear and home
+#endif
+#define  LCD_POWER_ON_US    15000  // after Vcc rises to 4.5 V
+#define  LCD_INIT_US        4100   // after the first function set
+#define  LCD_INIT_SHORT_US  100    // after the second function set
+
+// Decimal mark used by LCD_PutDecimal
+#ifndef LCD_DECIMAL_MARK
+#define  LCD_DECIMAL_MARK  ','
+#endif
+
+// Icons drawn with CGRAM glyphs. For use in strings: "OK " LCD_ICON_OK
+#define  LCD_ICON_OK     "\x80"
+#define  LCD_ICON_ERROR  "\x81"
+#define  LCD_ICON_CARD   "\x82"
+
+// Largest display supported
+#define  LCD_MAX_COLUMNS  20
+#define  LCD_MAX_ROWS     4
+
 
 //////////////////////////////////////////////////////////////////////
 //
@@ -33,27 +74,58 @@
 extern "C" {
 #endif
 
-// Initialize the LCD controller. Set number of columns.
-void LCD_Init(unsigned char lcd_columns);
+// Initialize the LCD controller. Set number of columns and rows.
+void LCD_Init(unsigned char lcd_columns, unsigned char lcd_rows);
 
-// Clear the LCD display
+// Clear the LCD display. Only cells that are not blank are written
 void LCD_Clear(void);
 
 // Set the LCD display position.
 // x = column, starting at 0. y = row, starting at 0.
 void LCD_GotoXY(unsigned char x, unsigned char y);
 
-// Write a character to the LCD
+// Write a character to the LCD. Text may be UTF-8 or Latin-1. Danish
+// letters and the LCD_ICON_* are drawn with CGRAM glyphs
 void LCD_PutChar(char c);
 
 // Write a zero-terminated ASCII string to the LCD
 void LCD_PutString(const char *str);
 
-// Delay. Approximately 200 microseconds at 10 MHz
-void LCD_delay(void) __attribute__ ((noinline));
+// Write a zero-terminated ASCII string on line y, padded with spaces
+void LCD_PutLine(const char *str, unsigned char y);
+
+// Write a zero-terminated ASCII string stored in flash to the LCD
+void LCD_PutString_P(PGM_P str);
+
+// Write a zero-terminated ASCII string stored in flash on line y,
+// padded with spaces
+void LCD_PutLine_P(PGM_P str, unsigned char y);
+
+// Write a signed number right-aligned in a field of width columns at
+// the cursor. The last decimals digits are put after LCD_DECIMAL_MARK,
+// so 12345 with 2 decimals is written as 123,45
+void LCD_PutDecimal(long value, unsigned char decimals, unsigned char width);
+
+// Scroll str on line y (0 or 1) by shifting the display one position
+// every step_ms milliseconds. Up to 40 characters, UTF-8 or Latin-1
+// as for LCD_PutChar. All lines move, so the other line should be
+// blank. With more than two rows the text is written as a line instead
+void LCD_Marquee(const char *str, unsigned char y, unsigned int step_ms);
+
+// As LCD_Marquee, with the text stored in flash
+void LCD_Marquee_P(PGM_P str, unsigned char y, unsigned int step_ms);
+
+// Stop the marquee. The line shows its first characters again
+void LCD_MarqueeStop(void);
+
+// Send the next nibble of queued output. Call from a 1 kHz timer interrupt
+void LCD_OnTick(void);
+
+// Delay. LCD_EXEC_US microseconds
+void LCD_delay(void);
 
-// Long delay. Approximately 26 miliseconds at 10 MHz
-void LCD_long_delay(void) __attribute__ ((noinline));
+// Long delay. LCD_CLEAR_US microseconds
+void LCD_long_delay(void);
 
 #ifdef __cplusplus
 }
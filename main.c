@@ -16,24 +16,30 @@ Date:		2012-12-01
 #include "config.h"
 #include <stdint.h>
 #include <string.h>
-#include <stdio.h>
 #include <avr/io.h>
 #include <avr/wdt.h>
+#include <avr/sleep.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include <util/delay.h>
 
 #include "usbdrv/usbdrv.h"
 #include "common.h"
 #include "lcd.h"
+#include "layout.h"
+#include "download.h"
 #include "usb.h"
 #include "rfid.h"
+#include "tick.h"
 #include "test.h"
 #include "lang.h"
 
 
 /**
- * Forward declaration of setStatus
+ * Forward declaration of showMessage_P
  */
-static void setStatus(const char *, uint8_t);
+static void showMessage_P(PGM_P);
 
 /**
  * Struct with information about responses from the server
@@ -63,7 +69,27 @@ struct transaction {
 	/**
 	 * The card ID read 
 	 */
-	uint8_t card_id[8];
+	uint8_t card_id[RFID_ID_MAX_LENGTH];
+
+	/**
+	 * Number of bytes in the card ID
+	 */
+	uint8_t card_id_length;
+
+	/**
+	 * Tick count when the card arrived at the reader
+	 */
+	uint16_t arrived;
+
+	/**
+	 * Transaction ID sent with the card event, 0 when none
+	 */
+	uint8_t id;
+
+	/**
+	 * Deadline for the response from the server
+	 */
+	uint16_t deadline;
 
 	/**
 	 * The latest command requested by the server
@@ -77,6 +103,94 @@ struct transaction {
 
 };
 
+/**
+ * A card event sent to the server and not answered yet
+ */
+struct pending_scan {
+	/**
+	 * Transaction ID. Free entries have ID 0.
+	 */
+	volatile uint8_t id;
+
+	/**
+	 * Set by usbFunctionWrite when the response has arrived
+	 */
+	volatile uint8_t answered;
+
+	/**
+	 * The card ID
+	 */
+	uint8_t card_id[RFID_ID_MAX_LENGTH];
+
+	/**
+	 * Number of bytes in the card ID
+	 */
+	uint8_t card_id_length;
+
+	/**
+	 * Tick count when the card event was queued
+	 */
+	uint16_t sent;
+
+	/**
+	 * The response, valid when answered is set
+	 */
+	struct response response;
+};
+
+/**
+ * Number of card events that can wait for a response at once
+ */
+#define PENDING_SIZE		4
+
+/**
+ * Time in milliseconds the terminal waits for the response to
+ * show it. The scan stays pending for PENDING_LIFETIME_MS, so 
+ * a late response is still remembered for the next scan.
+ */
+#define RESPONSE_TIMEOUT_MS	3000
+#define PENDING_LIFETIME_MS	10000
+
+/**
+ * A card recently answered by the server
+ */
+struct recent_scan {
+	/**
+	 * The card ID. Unused entries have length zero.
+	 */
+	uint8_t card_id[RFID_ID_MAX_LENGTH];
+
+	/**
+	 * Number of bytes in the card ID
+	 */
+	uint8_t card_id_length;
+
+	/**
+	 * Tick count when the response was received
+	 */
+	uint16_t time;
+
+	/**
+	 * The response received
+	 */
+	struct response response;
+};
+
+/**
+ * Number of recent scans remembered
+ */
+#define RECENT_SIZE		4
+
+/**
+ * Default time in milliseconds a repeated scan is answered locally
+ */
+#define RECENT_WINDOW_MS	10000
+
+/**
+ * Longest allowed dedup window. Must stay well below the tick wrap.
+ */
+#define RECENT_WINDOW_MAX	30000
+
 /**
  * Enum of possible terminal states
  */
@@ -92,6 +206,128 @@ static uint8_t use_buzzer;
  */
 static uint8_t reply_buffer[8];
 
+/**
+ * Card events waiting for a response
+ */
+static struct pending_scan pending[PENDING_SIZE];
+
+/**
+ * Transaction ID for the next card event. Never 0.
+ */
+static uint8_t next_id = 1;
+
+/**
+ * Transaction ID given with the CMD_RESPONSE being received
+ */
+static uint8_t response_id;
+
+/**
+ * Room for host text in a field, including the terminator. 
+ * Longer text is cut, and the field width may cut it further.
+ */
+#define HOST_TEXT_SIZE		21
+
+/**
+ * Room for host text that may scroll, a whole DDRAM line of 40
+ * characters and the terminator. Longer text is cut.
+ */
+#define HOST_LONG_SIZE		41
+
+/**
+ * Longest timeout for host text. Must stay well below the tick wrap.
+ */
+#define HOST_TIMEOUT_MAX	30000
+
+/**
+ * Text set by CMD_DISPLAY_TEXT for each layout field. Shown 
+ * instead of the idle screen when any field has text.
+ */
+static char host_text[LAYOUT_FIELDS][HOST_TEXT_SIZE];
+
+/**
+ * Time in ms the text of each field is shown, 0 for no timeout
+ */
+static uint16_t host_timeout[LAYOUT_FIELDS];
+
+/**
+ * Host text being received, the field and timeout it is for, and 
+ * the number of bytes of the data stage still to come. Only stored
+ * in host_text and host_timeout when the data stage is complete.
+ */
+static char host_incoming[HOST_LONG_SIZE];
+static uint8_t host_field;
+static uint16_t host_incoming_timeout;
+static uint8_t host_received;
+static uint16_t host_remaining;
+
+/**
+ * One bit per field, set by the USB handlers when its host_text 
+ * has changed
+ */
+static volatile uint8_t host_changed;
+
+/**
+ * Counts the changes the USB handlers make to the text and timeout
+ * of each field, so the main loop can copy them without disabling
+ * interrupts
+ */
+static volatile uint8_t host_seq[LAYOUT_FIELDS];
+
+/**
+ * Text longer than HOST_TEXT_SIZE - 1 bytes, kept whole for the 
+ * marquee, and the field it belongs to. Only one field at a time 
+ * has long text. LAYOUT_FIELDS when none has.
+ */
+static char host_long[HOST_LONG_SIZE];
+static volatile uint8_t host_long_field = LAYOUT_FIELDS;
+
+/**
+ * Copy of host_text and host_long shown by the main loop
+ */
+static char host_shown[LAYOUT_FIELDS][HOST_TEXT_SIZE];
+static char host_shown_long[HOST_LONG_SIZE];
+static uint8_t host_shown_long_field = LAYOUT_FIELDS;
+
+/**
+ * When the host text of each field is removed, and one bit per 
+ * field that has a deadline
+ */
+static uint16_t host_deadline[LAYOUT_FIELDS];
+static uint8_t host_timed;
+
+/**
+ * Telemetry records that did not fit in the queue
+ */
+static uint8_t telemetry_dropped;
+
+/**
+ * Ring of cards recently answered by the server
+ */
+static struct recent_scan recent[RECENT_SIZE];
+
+/**
+ * Next entry in recent to overwrite
+ */
+static uint8_t recent_next;
+
+/**
+ * Time in milliseconds a repeated scan is answered locally.
+ * Zero disables it.
+ */
+static uint16_t recent_window;
+
+/**
+ * Dedup window set by CMD_SET_DEDUP_WINDOW. 0xFFFF when never set.
+ */
+static uint16_t EEMEM ee_recent_window = 0xFFFF;
+
+/**
+ * Window received by CMD_SET_DEDUP_WINDOW, applied and stored by
+ * the main loop when new_window_set is set
+ */
+static uint16_t new_window;
+static volatile uint8_t new_window_set;
+
 /**
  * First step in state flag
  */
@@ -125,6 +361,7 @@ volatile uint8_t echo_ready = 0;
 ISR(TIMER0_COMP_vect, ISR_NOBLOCK)
 {
 	usbPoll();
+	USB_PollEvents();
 }
 
 /**
@@ -184,6 +421,22 @@ isAlive(void)
 	}
 }
 
+/**
+ * Takes the long host text from its field, which is marked as
+ * changed. Called from the USB handlers, or with interrupts 
+ * disabled.
+ */
+static void 
+dropHostLong(void)
+{
+	if (host_long_field < LAYOUT_FIELDS)
+	{
+		host_seq[host_long_field]++;
+		host_changed |= 1 << host_long_field;
+		host_long_field = LAYOUT_FIELDS;
+	}
+}
+
 /**
  * USB request handler. Get called by the USB library every
  * time a request is made to the device. 
@@ -193,7 +446,8 @@ isAlive(void)
 usbMsgLen_t 
 usbFunctionSetup(uint8_t data[8])
 {
-    uint8_t len = 0;
+    usbMsgLen_t len = 0;
+    uint8_t i;
     current.command = data[1];
 
     if (data[1] == CMD_ECHO)
@@ -203,6 +457,8 @@ usbFunctionSetup(uint8_t data[8])
     }
     else if (data[1] == CMD_RESPONSE)
     {
+    	// wValue = transaction ID of the card event answered
+    	response_id = data[2];
     	len = USB_NO_MSG;
     }
     else if (data[1] == CMD_KEEP_ALIVE)
@@ -210,6 +466,105 @@ usbFunctionSetup(uint8_t data[8])
     	isAlive();
     	len = 0;
     } 
+    else if (data[1] == CMD_GET_SPI_CLOCK)
+    {
+    	// Clock setting and the resulting f_osc divider
+    	reply_buffer[0] = SPI_GetClock();
+    	reply_buffer[1] = 2 << reply_buffer[0];
+    	len = 2;
+    }
+    else if (data[1] == CMD_SET_READ_POLICY)
+    {
+    	// wValue = retries | vote << 8, wIndex = backoff in ms
+    	struct rfid_policy policy;
+    	policy.retries = data[2];
+    	policy.vote = data[3];
+    	policy.backoff = data[4];
+    	RFID_SetPolicy(&policy);
+    	len = 0;
+    }
+    else if (data[1] == CMD_SET_DEDUP_WINDOW)
+    {
+    	// wValue = window in ms, zero disables
+    	new_window = data[2] | (data[3] << 8);
+    	if (new_window > RECENT_WINDOW_MAX)
+    	{
+    		new_window = RECENT_WINDOW_MAX;
+    	}
+    	new_window_set = 1;
+    	len = 0;
+    }
+    else if (data[1] == CMD_DOWNLOAD_BEGIN)
+    {
+    	// wValue = blob type, wIndex = blob length
+    	Download_Begin(data[2], data[4] | (data[5] << 8));
+    	len = 0;
+    }
+    else if (data[1] == CMD_DOWNLOAD)
+    {
+    	// wIndex = offset, the data stage holds the chunk
+    	Download_Seek(data[4] | (data[5] << 8), data[6] | (data[7] << 8));
+    	len = USB_NO_MSG;
+    }
+    else if (data[1] == CMD_DOWNLOAD_COMMIT)
+    {
+    	// wValue = CRC-CCITT of the blob
+    	Download_Commit(data[2] | (data[3] << 8));
+    	len = 0;
+    }
+    else if (data[1] == CMD_GET_DOWNLOAD_STATUS)
+    {
+    	// Status, blob type and the offset to resume from
+    	Download_GetStatus((struct download_status *) reply_buffer);
+    	len = sizeof(struct download_status);
+    }
+    else if (data[1] == CMD_DISPLAY_TEXT)
+    {
+    	// wValue = field, wIndex = timeout in ms, the data stage holds 
+    	// the text. No text clears the field. Each field keeps the 
+    	// timeout sent with its text. Text longer than the field
+    	// scrolls when the field can, see Layout_SetMarquee, and
+    	// is cut at HOST_LONG_SIZE - 1 bytes.
+    	host_field = data[2];
+    	host_incoming_timeout = data[4] | (data[5] << 8);
+    	if (host_incoming_timeout > HOST_TIMEOUT_MAX)
+    	{
+    		host_incoming_timeout = HOST_TIMEOUT_MAX;
+    	}
+    	host_remaining = data[6] | (data[7] << 8);
+    	host_received = 0;
+
+    	if (host_field == DISPLAY_CLEAR_ALL)
+    	{
+    		memset(host_text, 0, sizeof(host_text));
+    		dropHostLong();
+    		for (i = 0; i < LAYOUT_FIELDS; i++)
+    		{
+    			host_seq[i]++;
+    		}
+    		host_changed = (1 << LAYOUT_FIELDS) - 1;
+    	}
+    	else if (host_field < LAYOUT_FIELDS && host_remaining == 0)
+    	{
+    		host_text[host_field][0] = 0;
+    		if (host_long_field == host_field)
+    		{
+    			dropHostLong();
+    		}
+    		host_seq[host_field]++;
+    		host_changed |= 1 << host_field;
+    	}
+    	else if (host_field < LAYOUT_FIELDS)
+    	{
+    		len = USB_NO_MSG;
+    	}
+    }
+    else if (data[1] == CMD_GET_READ_STATS)
+    {
+    	// First try, retried and failed counts, little endian
+    	RFID_GetStats((struct rfid_stats *) reply_buffer);
+    	len = sizeof(struct rfid_stats);
+    }
 
     usbMsgPtr = reply_buffer;
     return len;
@@ -225,22 +580,92 @@ usbFunctionSetup(uint8_t data[8])
 USB_PUBLIC uint8_t 
 usbFunctionWrite(uint8_t *data, uint8_t len)
 {
-	current.response.code = data[0];
+	uint8_t k;
+	struct pending_scan * p;
 
 	if (current.command == CMD_RESPONSE)
 	{
-		if ( current.response.code == RESP_CHECKED_IN 
-			|| current.response.code == RESP_CHECKED_OUT 
-			|| current.response.code == RESP_INSUFFICIENT_FUNDS) 
+		// Responses to unknown or answered scans are dropped
+		for (k = 0; k < PENDING_SIZE; k++)
+		{
+			p = &pending[k];
+			if (p->id == response_id && p->id != 0 && !p->answered)
+			{
+				break;
+			}
+		}
+		if (k == PENDING_SIZE)
 		{
-			current.response.balance = data[2] | (data[1] << 8);
+			return 1;
 		}
 
-		if ( current.response.code == RESP_CHECKED_OUT 
-			|| current.response.code == RESP_INSUFFICIENT_FUNDS )
+		p->response.code = data[0];
+
+		if ( p->response.code == RESP_CHECKED_IN 
+			|| p->response.code == RESP_CHECKED_OUT 
+			|| p->response.code == RESP_INSUFFICIENT_FUNDS) 
+		{
+			p->response.balance = data[2] | (data[1] << 8);
+		}
+
+		if ( p->response.code == RESP_CHECKED_OUT 
+			|| p->response.code == RESP_INSUFFICIENT_FUNDS )
 		{
-			current.response.price = data[4] | (data[3] << 8); 
+			p->response.price = data[4] | (data[3] << 8); 
 		}
+
+		p->answered = 1;
+	}
+	else if (current.command == CMD_DOWNLOAD)
+	{
+		return Download_Write(data, len);
+	}
+	else if (current.command == CMD_DISPLAY_TEXT)
+	{
+		// Text longer than HOST_LONG_SIZE - 1 bytes is cut
+		for (; len > 0 && host_remaining > 0; len--, host_remaining--)
+		{
+			if (host_received < HOST_LONG_SIZE - 1)
+			{
+				host_incoming[host_received++] = *data;
+			}
+			data++;
+		}
+		if (host_remaining > 0)
+		{
+			return 0;
+		}
+
+		host_incoming[host_received] = 0;
+
+		// The field keeps as much as fits, without half a UTF-8 
+		// pair at the end. Longer text is also kept whole.
+		len = host_received;
+		if (len > HOST_TEXT_SIZE - 1)
+		{
+			len = HOST_TEXT_SIZE - 1;
+			if ((uint8_t)host_incoming[len - 1] == 0xC2 
+				|| (uint8_t)host_incoming[len - 1] == 0xC3)
+			{
+				len--;
+			}
+		}
+		memcpy(host_text[host_field], host_incoming, len);
+		host_text[host_field][len] = 0;
+
+		if (host_long_field == host_field || len < host_received)
+		{
+			dropHostLong();
+		}
+		if (len < host_received)
+		{
+			memcpy(host_long, host_incoming, host_received + 1);
+			host_long_field = host_field;
+		}
+
+		host_timeout[host_field] = host_incoming_timeout;
+		host_seq[host_field]++;
+		host_changed |= 1 << host_field;
 	}
 	else if (current.command == CMD_ECHO)
 	{
@@ -252,39 +677,421 @@ usbFunctionWrite(uint8_t *data, uint8_t len)
 }
 
 /**
- * Prints the given message on the given line.
- * The line are cleared before print.
+ * Shows a screen with just a title.
  * 
- * @param msg The string to print
- * @param msg The line number
+ * @param msg The title, in flash
  */
 static void 
-setStatus(const char * msg, uint8_t line)
+showMessage_P(PGM_P msg)
 {
-	LCD_GotoXY(0, line);
-	LCD_PutString("                ");
-	LCD_GotoXY(0, line);
-	LCD_PutString(msg);
+	Layout_Begin();
+	Layout_SetText_P(LAYOUT_TITLE, msg);
+	Layout_End();
 }
 
 /**
- * @return Non-zero if the black button is pressed.
+ * Copies the host text of a field into host_shown, and its long
+ * text, if any, into host_shown_long. The USB interrupt is not 
+ * blocked. Instead the copy is made again if the interrupt 
+ * changed the field meanwhile.
+ *
+ * @param k The field
+ * @return The timeout of the field
  */
-static uint8_t
-isButtonPressed(void)
+static uint16_t 
+copyHostText(uint8_t k)
 {
-	return (BTN_PORT & (1 << BTN_PIN)) == 0;
+	const volatile char * text = host_text[k];
+	const volatile char * long_text = host_long;
+	uint16_t timeout;
+	uint8_t seq, i, is_long;
+
+	do
+	{
+		seq = host_seq[k];
+		for (i = 0; i < HOST_TEXT_SIZE; i++)
+		{
+			host_shown[k][i] = text[i];
+		}
+		timeout = ((const volatile uint16_t *) host_timeout)[k];
+
+		is_long = host_long_field == k;
+		for (i = 0; is_long && i < HOST_LONG_SIZE; i++)
+		{
+			host_shown_long[i] = long_text[i];
+		}
+	}
+	while (seq != host_seq[k]);
+
+	if (is_long)
+	{
+		host_shown_long_field = k;
+	}
+	else if (host_shown_long_field == k)
+	{
+		host_shown_long_field = LAYOUT_FIELDS;
+	}
+
+	return timeout;
+}
+
+/**
+ * Shows the text set by the host, if any. Only the fields that
+ * have changed are copied. The timeout of a field starts when 
+ * new text is shown in it.
+ *
+ * @return Non-zero if host text is shown
+ */
+static uint8_t 
+showHostText(void)
+{
+	uint16_t now = Tick_Now();
+	uint16_t timeout;
+	uint8_t k, changed, shown = 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		changed = host_changed;
+		host_changed = 0;
+	}
+
+	Layout_Begin();
+	for (k = 0; k < LAYOUT_FIELDS; k++)
+	{
+		if (changed & (1 << k))
+		{
+			timeout = copyHostText(k);
+			host_deadline[k] = now + timeout;
+			if (host_shown[k][0] != 0 && timeout != 0)
+			{
+				host_timed |= 1 << k;
+			}
+			else
+			{
+				host_timed &= ~(1 << k);
+			}
+		}
+
+		if (host_shown_long_field == k)
+		{
+			Layout_SetMarquee(k, host_shown_long);
+			shown = 1;
+		}
+		else if (host_shown[k][0] != 0)
+		{
+			Layout_SetText(k, host_shown[k]);
+			shown = 1;
+		}
+	}
+
+	if (shown)
+	{
+		Layout_End();
+	}
+
+	return shown;
+}
+
+/**
+ * Forgets the host text of each field whose timeout has passed. 
+ * Called on every pass of the main loop, so a deadline is never 
+ * missed by a tick count wrap.
+ *
+ * @return Non-zero if host text was just removed
+ */
+static uint8_t 
+expireHostText(void)
+{
+	uint8_t k, expired = 0;
+
+	for (k = 0; k < LAYOUT_FIELDS; k++)
+	{
+		if (!(host_timed & (1 << k)) || !Tick_Expired(host_deadline[k]))
+		{
+			continue;
+		}
+
+		host_timed &= ~(1 << k);
+		expired = 1;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			// Text sent after the one shown has its own timeout
+			if (!(host_changed & (1 << k)))
+			{
+				host_text[k][0] = 0;
+				if (host_long_field == k)
+				{
+					dropHostLong();
+				}
+				host_seq[k]++;
+				host_changed |= 1 << k;
+			}
+		}
+	}
+
+	return expired;
+}
+
+/**
+ * Gives the current card a transaction ID and a pending entry, 
+ * then queues the card event: the transaction ID, the ID length 
+ * and the ID. When all entries are in use, the oldest scan is 
+ * given up. If the event queue is full the scan times out.
+ */
+static void 
+queueCardEvent(void)
+{
+	uint8_t k, oldest = 0;
+	uint16_t now = Tick_Now();
+	struct pending_scan * p;
+	uint8_t event[2 + RFID_ID_MAX_LENGTH];
+
+	for (k = 0; k < PENDING_SIZE; k++)
+	{
+		if (pending[k].id == 0)
+		{
+			oldest = k;
+			break;
+		}
+		if ((uint16_t)(now - pending[k].sent) > (uint16_t)(now - pending[oldest].sent))
+		{
+			oldest = k;
+		}
+	}
+
+	current.id = next_id++;
+	if (next_id == 0)
+	{
+		next_id = 1;
+	}
+	current.deadline = now + RESPONSE_TIMEOUT_MS;
+
+	p = &pending[oldest];
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		memcpy(p->card_id, current.card_id, current.card_id_length);
+		p->card_id_length = current.card_id_length;
+		p->sent = now;
+		p->answered = 0;
+		p->id = current.id;
+	}
+
+	event[0] = current.id;
+	event[1] = current.card_id_length;
+	memcpy(event + 2, current.card_id, current.card_id_length);
+	USB_QueueEvent(event, current.card_id_length + 2);
+}
+
+/**
+ * Applies and stores a dedup window set by the host. EEPROM is 
+ * written here and not in the USB interrupt.
+ */
+static void 
+saveRecentWindow(void)
+{
+	if (!new_window_set)
+	{
+		return;
+	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		recent_window = new_window;
+		new_window_set = 0;
+	}
+	eeprom_update_word(&ee_recent_window, recent_window);
+}
+
+/**
+ * Forgets recent scans older than the dedup window. Called on every
+ * pass of the main loop, so no entry lives long enough for the tick 
+ * count to wrap.
+ */
+static void 
+expireRecent(void)
+{
+	uint8_t k;
+	uint16_t now = Tick_Now();
+
+	for (k = 0; k < RECENT_SIZE; k++)
+	{
+		if ((uint16_t)(now - recent[k].time) >= recent_window)
+		{
+			recent[k].card_id_length = 0;
+		}
+	}
+}
+
+/**
+ * Looks up the current card among the recent scans, and copies 
+ * the response if found.
+ *
+ * @return Non-zero if the card was answered within the dedup window
+ */
+static uint8_t 
+findRecent(void)
+{
+	uint8_t k;
+
+	for (k = 0; k < RECENT_SIZE; k++)
+	{
+		if (recent[k].card_id_length == current.card_id_length
+			&& current.card_id_length != 0
+			&& memcmp(recent[k].card_id, current.card_id, current.card_id_length) == 0)
+		{
+			current.response = recent[k].response;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Remembers the response to an answered scan. Errors are not 
+ * remembered, so the next scan asks the server again.
+ *
+ * @param p The answered scan
+ */
+static void 
+rememberRecent(const struct pending_scan * p)
+{
+	struct recent_scan * r = &recent[recent_next];
+
+	if (recent_window == 0 || p->response.code == RESP_ERROR 
+		|| p->response.code > RESP_OK)
+	{
+		return;
+	}
+
+	memcpy(r->card_id, p->card_id, p->card_id_length);
+	r->card_id_length = p->card_id_length;
+	r->time = Tick_Now();
+	r->response = p->response;
+
+	recent_next = (recent_next + 1) % RECENT_SIZE;
+}
+
+/**
+ * Queues a telemetry record, counting it if the queue is full.
+ *
+ * @param record The record
+ * @param length Number of bytes in the record
+ */
+static void 
+sendTelemetry(const uint8_t * record, uint8_t length)
+{
+	if (!USB_QueueTelemetry(record, length) && telemetry_dropped < 0xFF)
+	{
+		telemetry_dropped++;
+	}
+}
+
+/**
+ * Reports a state change, and the read counters when a scan
+ * has ended.
+ */
+static void 
+reportState(void)
+{
+	uint8_t record[EVENT_PACKET_SIZE];
+	uint16_t now = Tick_Now();
+
+	record[0] = TELEMETRY_STATE;
+	record[1] = state;
+	record[2] = now & 0xFF;
+	record[3] = now >> 8;
+	sendTelemetry(record, 4);
+
+	if (state == info)
+	{
+		record[0] = TELEMETRY_STATS;
+		RFID_GetStats((struct rfid_stats *) (record + 1));
+		record[1 + sizeof(struct rfid_stats)] = telemetry_dropped;
+		sendTelemetry(record, 2 + sizeof(struct rfid_stats));
+	}
 }
 
 /**
- * Creates a string like "Saldo: [current balance] kr"
+ * Takes the response to the current scan, if it has arrived.
  *
- * @param buffer The buffer we write the string to
+ * @return Non-zero if current.response now holds the response
+ */
+static uint8_t 
+takeResponse(void)
+{
+	uint8_t k;
+	uint8_t trace[7];
+	uint16_t now = Tick_Now();
+	uint16_t elapsed, total;
+
+	for (k = 0; k < PENDING_SIZE; k++)
+	{
+		if (pending[k].id == current.id && pending[k].answered)
+		{
+			// Time from card event to response, and from the card
+			// arriving at the reader to response
+			elapsed = now - pending[k].sent;
+			total = now - current.arrived;
+			trace[0] = TELEMETRY_TRACE;
+			trace[1] = current.id;
+			trace[2] = pending[k].response.code;
+			trace[3] = elapsed & 0xFF;
+			trace[4] = elapsed >> 8;
+			trace[5] = total & 0xFF;
+			trace[6] = total >> 8;
+			sendTelemetry(trace, 7);
+
+			current.response = pending[k].response;
+			rememberRecent(&pending[k]);
+			pending[k].id = 0;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Handles scans that are no longer shown. Late responses are 
+ * remembered for the next scan of the card, and scans without a
+ * response are given up after PENDING_LIFETIME_MS. Called on every
+ * pass of the main loop.
  */
 static void 
-makeBalance(char *buffer)
+expirePending(void)
+{
+	uint8_t k;
+	uint16_t now = Tick_Now();
+	struct pending_scan * p;
+
+	for (k = 0; k < PENDING_SIZE; k++)
+	{
+		p = &pending[k];
+		if (p->id == 0 || (p->id == current.id && state == processing))
+		{
+			continue;
+		}
+
+		if (p->answered)
+		{
+			rememberRecent(p);
+			p->id = 0;
+		}
+		else if ((uint16_t)(now - p->sent) >= PENDING_LIFETIME_MS)
+		{
+			p->id = 0;
+		}
+	}
+}
+
+/**
+ * @return Non-zero if the black button is pressed.
+ */
+static uint8_t
+isButtonPressed(void)
 {
-	sprintf(buffer, L_BALANCE, current.response.balance);
+	return (BTN_PORT & (1 << BTN_PIN)) == 0;
 }
 
 /**
@@ -297,6 +1104,14 @@ setup(void)
 
 	use_buzzer = 1;
 
+	set_sleep_mode(SLEEP_MODE_IDLE);
+
+	recent_window = eeprom_read_word(&ee_recent_window);
+	if (recent_window > RECENT_WINDOW_MAX)
+	{
+		recent_window = RECENT_WINDOW_MS;
+	}
+
 	DDRC |= (1 << RED_PIN) | (1 << YELLOW_PIN) | (1 << GREEN_PIN) | (1 << SPEAKER_PIN);
 	PORTC |= 0x0E;
 
@@ -308,9 +1123,10 @@ setup(void)
 	OCR0 = 255; // 1024 prescaler --> 250 Hz
 	TIMSK |= (1 << OCIE0);
 
-	LCD_Init(16);
-	LCD_Clear();
-	LCD_GotoXY(0, 0);
+	// TIMER2: System tick
+	Tick_Init();
+
+	Layout_Init();
 
 	USB_InitAndConnect();
 
@@ -321,6 +1137,7 @@ setup(void)
 	TCCR0 |=  (1 << CS02) | (1 << CS00); 
 
 	RFID_Init();
+	RFID_TuneClock();
 }
 
 /**
@@ -333,9 +1150,10 @@ main(void)
 {
 	// Utility counter variables
 	unsigned int i = 0;
-	unsigned char j = 0;
-	// Buffer used when generating output for the display
-	char buf[16];
+	// Card present event from the RFID module
+	struct rfid_event event;
+	// State last reported on the telemetry endpoint
+	uint8_t reported_state = 0xFF;
 
 	// Perform setup of registers and peripherals
 	setup();
@@ -356,6 +1174,29 @@ main(void)
 		for (;;)
 		{
 			wdt_reset();
+			saveRecentWindow();
+			expireRecent();
+			expirePending();
+			RFID_SavePolicy();
+
+			if (state != reported_state)
+			{
+				// The keep-alive timer may end a scan in the middle 
+				// of a read, leaving its frame open
+				if (reported_state == scanning)
+				{
+					RFID_CancelRead();
+				}
+				reported_state = state;
+				reportState();
+			}
+
+			// A downloaded layout clears the display, and timed out
+			// host text reverts to the idle screen
+			if ((Download_Poll() | expireHostText()) && state == idle)
+			{
+				first_step = 1;
+			}
 
 			switch (state)
 			{
@@ -363,8 +1204,7 @@ main(void)
 				{
 					// Start-up phase.
 					// Do nothing in a bunch of clock cycles
-					setStatus(L_STARTING, 0);
-					setStatus("", 1);
+					showMessage_P(L_STARTING);
 
 					for (i = 0; i < 100; i++) 
 					{
@@ -380,20 +1220,42 @@ main(void)
 				{
 					GREEN_ON;
 
+					if (host_changed)
+					{
+						first_step = 1;
+					}
+
 					if (first_step)
 					{
 						first_step = 0;
 
-						setStatus(L_SCAN_HERE, 0);
-						setStatus("", 1);
+						if (!showHostText())
+						{
+							showMessage_P(L_SCAN_HERE);
+						}
 					}
 					
+					// Arrivals are reported by the card present interrupt,
+					// which also wakes us up from sleep
+					while (RFID_GetEvent(&event))
+					{
+						if (event.type == RFID_EVENT_ARRIVED)
+						{
+							current.arrived = event.time;
+						}
+					}
+
 					if (RFID_IsCardPresent())
 					{
 						GREEN_OFF;
 						first_step = 1;
 						state = scanning;
 					}
+					else
+					{
+						// Sleep until the next interrupt
+						sleep_mode();
+					}
 
 					break;
 				}
@@ -402,23 +1264,30 @@ main(void)
 					if (first_step)
 					{
 						first_step = 0;
-						setStatus(L_WORKING, 0);
+						showMessage_P(L_WORKING);
+						RFID_BeginReadId(current.card_id, &current.card_id_length);
 					}
 
-					uint8_t n = RFID_GetCardId(current.card_id);
-					if (n == -1) 
+					uint8_t n = RFID_PollReadId();
+					if (n == RFID_PENDING)
+					{
+						break;
+					}
+					else if (n != RFID_OK) 
 					{
 						state = info;
 						current.response.code = RESP_INVALID_CARD;
 						first_step = 1;
 					}
+					else if (findRecent())
+					{
+						// Double tap. Show the last response again.
+						first_step = 1;
+						state = info;
+					}
 					else
 					{
-						if (!usbInterruptIsReady())
-						{
-							wdt_reset();
-						}
-						usbSetInterrupt(current.card_id, 8);
+						queueCardEvent();
 
 						first_step = 1;
 						state = processing;
@@ -427,8 +1296,9 @@ main(void)
 				}
 				case processing:
 				{
-					if (current.response.code != 0)
+					if (takeResponse())
 					{
+
 						if (use_buzzer)
 						{
 							if (current.response.code == RESP_CHECKED_IN) 
@@ -453,99 +1323,96 @@ main(void)
 						break;
 					}
 
-					if (first_step)
+					// No response in time. Show an error, the scan 
+					// stays pending so a late response is remembered.
+					if (Tick_Expired(current.deadline))
 					{
-						i = j = 0;
-						first_step = 0;
-					}
-
-					// When we have been in this state in 500.000 ticks,
-					// we change the state to info, an set the response to error
-					i++;
-					if (i == 50000)
-					{
-						j++;
-						if (j == 10)
-						{
-							state = info;
-							current.response.code = 99;
-							first_step = 1;
-						}
+						state = info;
+						current.response.code = 99;
+						first_step = 1;
 					}
 					
 					break;
 				}
 				case info:
 				{
-					switch (current.response.code)
+					if (first_step)
 					{
-						case RESP_CHECKED_IN:
-						{
-							setStatus(L_CHECK_IN, 0);
-							makeBalance(buf);
-							setStatus(buf, 1);
+						first_step = 0;
 
-							break;
-						}
-						case RESP_CHECKED_OUT:
+						switch (current.response.code)
 						{
-							sprintf(buf, L_CHECK_OUT, current.response.price);
-							setStatus(buf, 0);
-							makeBalance(buf);
-							setStatus(buf, 1);
+							case RESP_CHECKED_IN:
+							{
+								Layout_Begin();
+								Layout_SetText_P(LAYOUT_TITLE, L_CHECK_IN);
+								Layout_SetAmount_P(LAYOUT_BALANCE, L_BALANCE, current.response.balance);
+								Layout_End();
 
-							break;
-						}
-						case RESP_INSUFFICIENT_FUNDS:
-						{
-							setStatus(L_INSUFFICIENT_FUNDS, 0);
-							makeBalance(buf);
-							setStatus(buf, 1);
+								break;
+							}
+							case RESP_CHECKED_OUT:
+							{
+								Layout_Begin();
+								Layout_SetText_P(LAYOUT_TITLE, L_CHECK_OUT);
+								Layout_SetAmount_P(LAYOUT_PRICE, L_CHECK_OUT, current.response.price);
+								Layout_SetAmount_P(LAYOUT_BALANCE, L_BALANCE, current.response.balance);
+								Layout_End();
 
-							break;
-						}
-						case RESP_CARD_NOT_FOUND:
-						case RESP_INVALID_CARD:
-						{
-							setStatus(L_INVALID_CARD, 0);
-							setStatus("", 1);
+								break;
+							}
+							case RESP_INSUFFICIENT_FUNDS:
+							{
+								Layout_Begin();
+								Layout_SetText_P(LAYOUT_TITLE, L_INSUFFICIENT_FUNDS);
+								Layout_SetAmount_P(LAYOUT_BALANCE, L_BALANCE, current.response.balance);
+								Layout_End();
 
-							break;
-						}
-						case RESP_TOO_LATE_CHECK_OUT:
-						{
-							setStatus(L_CHECK_OUT_TOO_LATE, 0);
-							setStatus(L_LATE_CHECK_OUT_FEE, 1);
+								break;
+							}
+							case RESP_CARD_NOT_FOUND:
+							case RESP_INVALID_CARD:
+							{
+								showMessage_P(L_INVALID_CARD);
 
-							break;
-						}
-						case RESP_OK:
-						{
-							setStatus(L_OK, 0);
-							setStatus("", 1);
+								break;
+							}
+							case RESP_TOO_LATE_CHECK_OUT:
+							{
+								Layout_Begin();
+								Layout_SetText_P(LAYOUT_TITLE, L_CHECK_OUT_TOO_LATE);
+								Layout_SetText_P(LAYOUT_FOOTER, L_LATE_CHECK_OUT_FEE);
+								Layout_End();
 
-							break;
-						}
-						default: 
-						{
-							setStatus(L_SYSTEM_ERROR, 0);
-							setStatus("", 1);
+								break;
+							}
+							case RESP_OK:
+							{
+								showMessage_P(L_OK);
 
-							break;
+								break;
+							}
+							default: 
+							{
+								showMessage_P(L_SYSTEM_ERROR);
+
+								break;
+							}
 						}
 					}
 
 					// Stay here until the customer removes the card
-					while ( RFID_IsCardPresent() ) 
+					if (RFID_IsCardPresent()) 
 					{
-						wdt_reset();
+						break;
 					}
 
 					state = idle;
 					first_step = 1;
 
 					current.response.code = 0;
-					memset(current.card_id, 0, 8);
+					memset(current.card_id, 0, RFID_ID_MAX_LENGTH);
+					current.card_id_length = 0;
 					
 					for (i = 0; i < 150; i++) 
 					{
@@ -563,8 +1430,7 @@ main(void)
 					{
 						first_step = 0;
 
-						setStatus(L_OUT_OF_ORDER, 0);
-						setStatus("", 1);
+						showMessage_P(L_OUT_OF_ORDER);
 					}
 
 					break;
@@ -6,6 +6,14 @@ This file contains functions related to the RFID card
 reader. This includes functions for reading the status
 of a card, and reading the card serial number.
 
+Bytes from the reader are clocked out by the INT1 handler
+as soon as the data ready line goes high, and are stored
+in a ring buffer until the RFID functions consume them.
+
+Card arrival and removal are seen by the INT0 handler. The
+first edge is reported at once, after which the line is
+ignored for RFID_DEBOUNCE_MS and then sampled again.
+
 Version: 	1
 Author: 	Jacob Pedersen
 Company:	IHK
@@ -15,8 +23,462 @@ Date:		2012-12-01
 
 #include <string.h>
 #include <avr/wdt.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "tick.h"
 #include "rfid.h"
 
+/**
+ * Size of the receive ring buffer. Must be a power of two.
+ */
+#define RING_SIZE			16
+#define RING_MASK			(RING_SIZE - 1)
+
+/**
+ * Bytes received from the reader. Written by the SPI interrupt,
+ * read by the main loop.
+ */
+static volatile uint8_t ring[RING_SIZE];
+
+/**
+ * Next free slot in the ring. Only changed by the producer.
+ */
+static volatile uint8_t ring_head;
+
+/**
+ * Next byte to consume. Only changed by the consumer.
+ */
+static volatile uint8_t ring_tail;
+
+/**
+ * Non-zero while a byte is being clocked out of the reader
+ */
+static volatile uint8_t capturing;
+
+/**
+ * Number of ticks data ready has been high with no byte on its way
+ */
+static uint8_t ready_ticks;
+
+/**
+ * SPI clock found by RFID_TuneClock. 0xFF when never tuned.
+ */
+static uint8_t EEMEM ee_spi_clock = 0xFF;
+
+/**
+ * Number of card reads in a row that failed on a bus symptom
+ */
+static uint8_t failures;
+
+/**
+ * Size of the card present event queue. Must be a power of two.
+ */
+#define EVENTS_SIZE			4
+#define EVENTS_MASK			(EVENTS_SIZE - 1)
+
+/**
+ * Card present events not yet consumed by the main loop
+ */
+static struct rfid_event events[EVENTS_SIZE];
+
+/**
+ * Next free slot in the event queue. Only changed by the producer.
+ */
+static volatile uint8_t events_head;
+
+/**
+ * Next event to consume. Only changed by the consumer.
+ */
+static volatile uint8_t events_tail;
+
+/**
+ * Debounced state of the card present line
+ */
+static volatile uint8_t card_present;
+
+/**
+ * Ticks left of the debounce window
+ */
+static volatile uint8_t debounce;
+
+/**
+ * Steps of the card ID read
+ */
+enum rfid_read_step_t { read_flush, read_status, read_byte, read_backoff };
+
+/**
+ * State of the card ID read in progress
+ */
+static struct {
+	/**
+	 * Buffer receiving the card ID
+	 */
+	uint8_t * buffer;
+
+	/**
+	 * Where to store the length of the card ID
+	 */
+	uint8_t * length;
+
+	/**
+	 * Number of ID bytes received
+	 */
+	uint8_t index;
+
+	/**
+	 * Tick count when the last ID byte was received
+	 */
+	uint16_t last;
+
+	/**
+	 * Current step
+	 */
+	enum rfid_read_step_t step;
+
+	/**
+	 * Tick count when the attempt is given up, or when the
+	 * next attempt starts while backing off
+	 */
+	uint16_t deadline;
+
+	/**
+	 * Number of retries used
+	 */
+	uint8_t retries;
+
+	/**
+	 * Non-zero if candidate holds the ID from the previous attempt
+	 */
+	uint8_t voted;
+} read;
+
+/**
+ * ID from the previous attempt, when voting
+ */
+static uint8_t candidate[RFID_ID_MAX_LENGTH];
+
+/**
+ * Length of the ID in candidate
+ */
+static uint8_t candidate_length;
+
+/**
+ * Retry policy for card ID reads
+ */
+static struct rfid_policy policy;
+
+/**
+ * Retry policy stored by RFID_SetPolicy. Erased (0xFF) when never set,
+ * and the defaults in the EEPROM image.
+ */
+static struct rfid_policy EEMEM ee_policy =
+{
+	RFID_DEFAULT_RETRIES, RFID_DEFAULT_BACKOFF_MS, RFID_DEFAULT_VOTE
+};
+
+/**
+ * Set when policy has changed and is not stored yet
+ */
+static volatile uint8_t policy_dirty;
+
+/**
+ * Card read counters since power-up
+ */
+static struct rfid_stats stats;
+
+/**
+ * @return Non-zero if the reader has a byte ready for us
+ */
+static uint8_t 
+IsDataReady(void)
+{
+	return (PIND & (1 << RFID_DATA_READY)) != 0;
+}
+
+/**
+ * SPI completion callback. Stores the byte clocked out of the 
+ * reader. The byte is dropped if the ring is full.
+ *
+ * @param data The received byte
+ */
+static void 
+Captured(uint8_t data)
+{
+	uint8_t head = ring_head;
+	uint8_t next = (head + 1) & RING_MASK;
+
+	if (next != ring_tail)
+	{
+		ring[head] = data;
+		ring_head = next;
+	}
+
+	capturing = 0;
+}
+
+/**
+ * SPI completion callback for commands, where the reply is
+ * meaningless.
+ *
+ * @param data The received byte
+ */
+static void 
+Ignore(uint8_t data)
+{
+}
+
+/**
+ * Clocks a byte out of the reader unless one is already on its way.
+ */
+static void 
+Capture(void)
+{
+	uint8_t claimed = 0;
+
+	// Only the test and set is atomic. The byte is submitted with
+	// interrupts enabled, and the claim undone if the queue is full
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (!capturing)
+		{
+			capturing = 1;
+			claimed = 1;
+		}
+	}
+
+	if (claimed && SPI_Submit(SPI_FILLER, Captured) == SPI_NO_HANDLE)
+	{
+		capturing = 0;
+	}
+}
+
+/**
+ * Data ready ISR. Triggered on the rising edge of the data 
+ * ready line.
+ */
+ISR(INT1_vect, ISR_NOBLOCK)
+{
+	Capture();
+}
+
+/**
+ * Samples the card present line and queues an event if it has 
+ * changed since the last report. Starts a new debounce window 
+ * when it has. Called from both the card present ISR and the 
+ * tick, so only the state and queue update is done with 
+ * interrupts disabled.
+ */
+static void 
+SampleCardPresent(void)
+{
+	uint16_t now = Tick_Now();
+	uint8_t level = (PIND & (1 << RFID_CARD_PRESENT)) != 0;
+	uint8_t head, next;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (level != card_present)
+		{
+			card_present = level;
+			debounce = RFID_DEBOUNCE_MS + 1;
+
+			head = events_head;
+			next = (head + 1) & EVENTS_MASK;
+			if (next != events_tail)
+			{
+				events[head].type = level ? RFID_EVENT_ARRIVED : RFID_EVENT_REMOVED;
+				events[head].time = now;
+				events_head = next;
+			}
+		}
+	}
+}
+
+/**
+ * Card present ISR. Triggered on any change of the card 
+ * present line. Edges inside the debounce window are ignored.
+ */
+ISR(INT0_vect, ISR_NOBLOCK)
+{
+	if (!debounce)
+	{
+		SampleCardPresent();
+	}
+}
+
+/**
+ * Closes the card present debounce window, and catches bytes where
+ * the data ready line stayed high after the previous byte, so no new
+ * edge was seen. The line must be high on two ticks in a row, so 
+ * the reader has had time to drop it after the previous byte.
+ * Called from the system tick.
+ */
+void 
+RFID_OnTick(void)
+{
+	uint8_t closed = 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (debounce && --debounce == 0)
+		{
+			closed = 1;
+		}
+	}
+
+	// Look at the line again when the debounce window closes
+	if (closed)
+	{
+		SampleCardPresent();
+	}
+
+	if (capturing || !IsDataReady() || !SPI_IsIdle())
+	{
+		ready_ticks = 0;
+	}
+	else if (++ready_ticks >= 2)
+	{
+		ready_ticks = 0;
+		Capture();
+	}
+}
+
+/**
+ * Takes the oldest received byte from the ring buffer.
+ *
+ * @param data Where to store the byte
+ * @return Non-zero if a byte was available
+ */
+static uint8_t 
+ReadByte(uint8_t * data)
+{
+	uint8_t tail = ring_tail;
+
+	if (tail == ring_head)
+	{
+		return 0;
+	}
+
+	*data = ring[tail];
+	ring_tail = (tail + 1) & RING_MASK;
+	return 1;
+}
+
+/**
+ * Discards received bytes.
+ *
+ * @return Non-zero if the reader has no more data for us
+ */
+static uint8_t 
+Flush(void)
+{
+	ring_tail = ring_head;
+	return !capturing && !IsDataReady();
+}
+
+/**
+ * Sets and stores the SPI clock.
+ *
+ * @param clock The clock setting
+ */
+static void 
+SaveClock(uint8_t clock)
+{
+	SPI_SetClock(clock);
+	eeprom_update_byte(&ee_spi_clock, clock);
+}
+
+/**
+ * Counts a read that failed on a bus symptom, and lowers the SPI 
+ * clock after RFID_FALLBACK_FAILURES such reads in a row.
+ */
+static void 
+ReadFailed(void)
+{
+	uint8_t clock = SPI_GetClock();
+
+	if (++failures >= RFID_FALLBACK_FAILURES && clock < SPI_CLOCK_SLOWEST)
+	{
+		failures = 0;
+		SaveClock(clock + 1);
+	}
+}
+
+/**
+ * Sends a status command and waits up to RFID_PROBE_MS for the reply.
+ * Slave select is held from the command until the reply.
+ *
+ * @param status Where to store the status
+ * @return RFID_OK, or RFID_ERR_TIMEOUT if the reader did not reply
+ */
+static uint8_t 
+Probe(uint8_t * status)
+{
+	uint16_t deadline = Tick_Now() + RFID_PROBE_MS;
+	uint8_t result = RFID_ERR_TIMEOUT;
+
+	while (!Flush())
+	{
+		if (Tick_Expired(deadline))
+		{
+			return RFID_ERR_TIMEOUT;
+		}
+		wdt_reset();
+	}
+
+	SPI_BeginFrame();
+
+	if (SPI_Submit(RFID_CMD_STATUS, Ignore) != SPI_NO_HANDLE)
+	{
+		while (!Tick_Expired(deadline))
+		{
+			if (ReadByte(status))
+			{
+				result = RFID_OK;
+				break;
+			}
+			wdt_reset();
+		}
+	}
+
+	SPI_EndFrame();
+	return result;
+}
+
+/**
+ * Finds the fastest SPI clock the reader can keep up with. 
+ * The status read at the slowest clock is the reference, and 
+ * a clock is accepted when two status reads both match it.
+ * If the reader does not answer at all, the stored clock is used.
+ */
+void 
+RFID_TuneClock(void)
+{
+	uint8_t clock, reference, status;
+
+	SPI_SetClock(SPI_CLOCK_SLOWEST);
+	if (Probe(&reference) != RFID_OK)
+	{
+		clock = eeprom_read_byte(&ee_spi_clock);
+		SPI_SetClock(clock <= SPI_CLOCK_SLOWEST ? clock : SPI_CLOCK_DEFAULT);
+		return;
+	}
+
+	for (clock = SPI_CLOCK_FASTEST; clock < SPI_CLOCK_SLOWEST; clock++)
+	{
+		SPI_SetClock(clock);
+
+		if (Probe(&status) == RFID_OK && status == reference 
+			&& Probe(&status) == RFID_OK && status == reference)
+		{
+			break;
+		}
+	}
+
+	SaveClock(clock);
+}
+
 /**
  * Initialize the RFID module.
  */
@@ -25,6 +487,21 @@ RFID_Init(void)
 {
 	SPI_Init();
 	DDRD = 0x0;
+
+	eeprom_read_block(&policy, &ee_policy, sizeof(policy));
+	if (policy.retries == 0xFF)
+	{
+		policy.retries = RFID_DEFAULT_RETRIES;
+		policy.backoff = RFID_DEFAULT_BACKOFF_MS;
+		policy.vote = RFID_DEFAULT_VOTE;
+	}
+
+	card_present = (PIND & (1 << RFID_CARD_PRESENT)) != 0;
+
+	// INT0 on any change of card present, 
+	// INT1 on the rising edge of data ready
+	MCUCR |= (1 << ISC00) | (1 << ISC11) | (1 << ISC10);
+	GICR |= (1 << INT0) | (1 << INT1);
 }
 
 /**
@@ -35,52 +512,349 @@ RFID_Init(void)
 uint8_t 
 RFID_IsCardPresent(void) 
 {
-	return (PIND & (1 << RFID_CARD_PRESENT));
+	return card_present;
+}
+
+/**
+ * Takes the oldest card present event from the queue.
+ *
+ * @param event Where to store the event
+ * @return Non-zero if an event was available
+ */
+uint8_t 
+RFID_GetEvent(struct rfid_event * event)
+{
+	uint8_t tail = events_tail;
+
+	if (tail == events_head)
+	{
+		return 0;
+	}
+
+	*event = events[tail];
+	events_tail = (tail + 1) & EVENTS_MASK;
+	return 1;
 }
 
 /**
  * Reads the card status.
  * 
- * @return The card status (See defines in rfid.h)
+ * @param status Where to store the card status
+ * @return RFID_OK, or RFID_ERR_TIMEOUT if the reader did not reply
  */
 uint8_t 
-RFID_GetCardStatus(void) 
+RFID_GetCardStatus(uint8_t * status) 
 {
-	SPI_Transmit(RFID_CMD_STATUS);
-	while((PIND & (1 << RFID_DATA_READY)) == 0);
-	return SPI_Receive();
+	return Probe(status);
 }
 
 /**
- * Reads the card identifier into the given buffer.
+ * Starts a single attempt at reading the card ID.
+ */
+static void 
+StartAttempt(void)
+{
+	read.index = 0;
+	read.step = read_flush;
+	read.deadline = Tick_Now() + RFID_READ_MS;
+}
+
+/**
+ * Starts reading the card identifier into the given buffer.
+ * Call RFID_PollReadId until it no longer returns RFID_PENDING.
  *
- * @param buffer The buffer that should hold the card ID
- * @return Zero on success, non-zero on failure
+ * @param buffer The buffer that should hold the card ID, 
+ * RFID_ID_MAX_LENGTH bytes
+ * @param length Where to store the length of the card ID
  */
-uint8_t 
-RFID_GetCardId(uint8_t * buffer) 
+void 
+RFID_BeginReadId(uint8_t * buffer, uint8_t * length)
 {
-	uint8_t i;
-	memset(buffer, 0, sizeof(buffer));
+	memset(buffer, 0, RFID_ID_MAX_LENGTH);
+	*length = 0;
 
-	SPI_Transmit(RFID_CMD_ID);
+	read.buffer = buffer;
+	read.length = length;
+	read.retries = 0;
+	read.voted = 0;
+	StartAttempt();
+}
 
-	while(!(PIND & (1<<RFID_DATA_READY)));
-	uint8_t status = SPI_Receive();
+/**
+ * Ends a single attempt.
+ *
+ * @param result The result of the attempt
+ * @return The result of the attempt
+ */
+static uint8_t 
+FinishAttempt(uint8_t result)
+{
+	SPI_EndFrame();
+	return result;
+}
+
+/**
+ * Advances a single attempt at reading the card ID.
+ *
+ * @return RFID_PENDING while the attempt is in progress, otherwise 
+ * the result of the attempt
+ */
+static uint8_t 
+PollAttempt(void)
+{
+	uint8_t data;
 
-	if (status != 0x86) 
+	if (Tick_Expired(read.deadline))
 	{
-		return -1;
+		return FinishAttempt(read.step == read_byte ? RFID_ERR_SHORT : RFID_ERR_TIMEOUT);
 	}
 
-	for (i = 0; i < 7; i++)
+	switch (read.step)
 	{
-		while((PIND & (1<<RFID_DATA_READY)) == 0) 
+		case read_flush:
 		{
-			wdt_reset();
+			// Empty possibly waiting data before sending the command
+			// Slave select is held from the command to the last ID byte
+			if (Flush())
+			{
+				SPI_BeginFrame();
+				if (SPI_Submit(RFID_CMD_ID, Ignore) != SPI_NO_HANDLE)
+				{
+					read.step = read_status;
+				}
+			}
+			break;
+		}
+		case read_status:
+		{
+			if (ReadByte(&data))
+			{
+				if (data != RFID_RESP_ACK)
+				{
+					return FinishAttempt(RFID_ERR_NAK);
+				}
+				read.step = read_byte;
+			}
+			break;
 		}
-		buffer[i] = SPI_Receive();
+		case read_byte:
+		{
+			while (ReadByte(&data))
+			{
+				read.buffer[read.index++] = data;
+				read.last = Tick_Now();
+
+				if (read.index == RFID_ID_MAX_LENGTH)
+				{
+					return FinishAttempt(RFID_OK);
+				}
+			}
+
+			// Shorter IDs end when the reader stops sending
+			if (read.index > 0 && Tick_Expired(read.last + RFID_FRAME_GAP_MS))
+			{
+				if (read.index == RFID_ID_SINGLE || read.index == RFID_ID_DOUBLE)
+				{
+					return FinishAttempt(RFID_OK);
+				}
+				return FinishAttempt(RFID_ERR_SHORT);
+			}
+			break;
+		}
+		case read_backoff:
+		{
+			break;
+		}
+	}
+
+	return RFID_PENDING;
+}
+
+/**
+ * Handles a failed attempt. Retries after the backoff time if the
+ * policy allows it and the card is still there.
+ *
+ * A read that fails for good counts toward the SPI clock fallback
+ * only if it ended in a timeout or a short frame with the card 
+ * still there. A NAK or a vote failure is the reader or the card 
+ * speaking clearly, and a card lifted early cuts the read short
+ * at any clock, so neither says anything about the bus.
+ *
+ * @param result The result of the failed attempt
+ * @return RFID_PENDING if the read is retried, otherwise the result
+ */
+static uint8_t 
+Retry(uint8_t result)
+{
+	if (read.retries >= policy.retries || !card_present)
+	{
+		stats.failed++;
+		if (card_present
+			&& (result == RFID_ERR_TIMEOUT || result == RFID_ERR_SHORT))
+		{
+			ReadFailed();
+		}
+		return result;
+	}
+
+	read.retries++;
+	read.step = read_backoff;
+	read.deadline = Tick_Now() + policy.backoff;
+	return RFID_PENDING;
+}
+
+/**
+ * Advances the card ID read started by RFID_BeginReadId.
+ * Never waits for the reader.
+ *
+ * Failed attempts are retried according to the retry policy. 
+ * If the policy asks for a vote, the ID is only accepted when two
+ * attempts in a row agree on it.
+ *
+ * @return RFID_PENDING while the read is in progress, RFID_OK 
+ * when the ID and its length are stored, RFID_ERR_NAK if the reader did not
+ * acknowledge the card, RFID_ERR_TIMEOUT if the reader did not 
+ * answer within RFID_READ_MS, RFID_ERR_SHORT if it stopped before
+ * a whole 4, 7 or 10 byte ID was sent, or RFID_ERR_VOTE if no two reads agreed
+ */
+uint8_t 
+RFID_PollReadId(void)
+{
+	uint8_t result;
+
+	if (read.step == read_backoff)
+	{
+		if (!Tick_Expired(read.deadline))
+		{
+			return RFID_PENDING;
+		}
+		StartAttempt();
+	}
+
+	result = PollAttempt();
+	if (result == RFID_PENDING)
+	{
+		return RFID_PENDING;
+	}
+	else if (result != RFID_OK)
+	{
+		return Retry(result);
+	}
+
+	if (policy.vote)
+	{
+		if (!read.voted || candidate_length != read.index
+			|| memcmp(candidate, read.buffer, read.index) != 0)
+		{
+			// Keep this ID and read it again. A disagreement
+			// counts as a failed attempt.
+			result = read.voted ? Retry(RFID_ERR_VOTE) : RFID_PENDING;
+
+			memcpy(candidate, read.buffer, read.index);
+			candidate_length = read.index;
+			read.voted = 1;
+
+			if (read.step != read_backoff && result == RFID_PENDING)
+			{
+				StartAttempt();
+			}
+			return result;
+		}
+	}
+
+	*read.length = read.index;
+	failures = 0;
+
+	if (read.retries == 0)
+	{
+		stats.first_try++;
+	}
+	else
+	{
+		stats.retried++;
+	}
+
+	return RFID_OK;
+}
+
+/**
+ * Gives up the card ID read in progress, if any, and releases
+ * slave select. Call when the read is abandoned before 
+ * RFID_PollReadId has returned a result.
+ */
+void 
+RFID_CancelRead(void)
+{
+	SPI_EndFrame();
+	read.step = read_flush;
+}
+
+/**
+ * Sets the retry policy for card ID reads. It is stored by the 
+ * next RFID_SavePolicy, as this may be called from the USB 
+ * interrupt where EEPROM must not be written.
+ *
+ * @param p The new policy
+ */
+void 
+RFID_SetPolicy(const struct rfid_policy * p)
+{
+	policy = *p;
+	policy_dirty = 1;
+}
+
+/**
+ * Stores the retry policy in EEPROM if it has changed. Called 
+ * from the main loop.
+ */
+void 
+RFID_SavePolicy(void)
+{
+	struct rfid_policy p;
+
+	if (!policy_dirty)
+	{
+		return;
+	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		p = policy;
+		policy_dirty = 0;
+	}
+	eeprom_update_block(&p, &ee_policy, sizeof(p));
+}
+
+/**
+ * Copies the card read counters.
+ *
+ * @param s Where to store the counters
+ */
+void 
+RFID_GetStats(struct rfid_stats * s)
+{
+	*s = stats;
+}
+
+/**
+ * Reads the card identifier into the given buffer.
+ * Blocks until the read is done.
+ *
+ * @param buffer The buffer that should hold the card ID, 
+ * RFID_ID_MAX_LENGTH bytes
+ * @param length Where to store the length of the card ID
+ * @return Zero on success, non-zero on failure
+ */
+uint8_t 
+RFID_GetCardId(uint8_t * buffer, uint8_t * length) 
+{
+	uint8_t result;
+
+	RFID_BeginReadId(buffer, length);
+	while ((result = RFID_PollReadId()) == RFID_PENDING)
+	{
+		wdt_reset();
 	}
 
-	return 0;
+	return result;
 }
@@ -23,17 +23,159 @@
  */
 #define RFID_RESP_ACK		0x86
 
+/**
+ * Card ID lengths in bytes. Single, double and triple size UIDs.
+ */
+#define RFID_ID_SINGLE		4
+#define RFID_ID_DOUBLE		7
+#define RFID_ID_TRIPLE		10
+#define RFID_ID_MAX_LENGTH	RFID_ID_TRIPLE
+
+/**
+ * Time in milliseconds without a byte from the reader that ends 
+ * a card ID shorter than RFID_ID_MAX_LENGTH
+ */
+#define RFID_FRAME_GAP_MS	20
+
+/**
+ * Time in milliseconds to wait for the reply to a status command
+ */
+#define RFID_PROBE_MS		50
+
+/**
+ * Time in milliseconds a card ID read may take
+ */
+#define RFID_READ_MS		250
+
+/**
+ * Default retry policy. A read is tried up to 1 + RFID_DEFAULT_RETRIES
+ * times, with RFID_DEFAULT_BACKOFF_MS between attempts.
+ */
+#define RFID_DEFAULT_RETRIES	2
+#define RFID_DEFAULT_BACKOFF_MS	30
+#define RFID_DEFAULT_VOTE		0
+
+/**
+ * Number of reads in a row failing on a timeout or short frame
+ * before the SPI clock is lowered
+ */
+#define RFID_FALLBACK_FAILURES	3
+
+/**
+ * Time in milliseconds the card present line must be stable
+ * before a new edge is reported
+ */
+#define RFID_DEBOUNCE_MS	20
+
+/**
+ * Card present events
+ */
+#define RFID_EVENT_ARRIVED	1
+#define RFID_EVENT_REMOVED	2
+
+/**
+ * A change of the card present line
+ */
+struct rfid_event {
+	/**
+	 * RFID_EVENT_ARRIVED or RFID_EVENT_REMOVED
+	 */
+	uint8_t type;
+
+	/**
+	 * Tick count when the edge was seen
+	 */
+	uint16_t time;
+};
+
+/**
+ * Results of RFID operations
+ */
+#define RFID_OK				0
+#define RFID_PENDING		1
+#define RFID_ERR_NAK		2
+#define RFID_ERR_TIMEOUT	3
+#define RFID_ERR_SHORT		4
+#define RFID_ERR_VOTE		5
+
+/**
+ * How card ID reads are retried
+ */
+struct rfid_policy {
+	/**
+	 * Number of extra attempts after a failed read
+	 */
+	uint8_t retries;
+
+	/**
+	 * Time in milliseconds between attempts
+	 */
+	uint8_t backoff;
+
+	/**
+	 * Non-zero to require two identical reads in a row
+	 */
+	uint8_t vote;
+};
+
+/**
+ * Card read counters
+ */
+struct rfid_stats {
+	/**
+	 * Reads that succeeded on the first attempt
+	 */
+	uint16_t first_try;
+
+	/**
+	 * Reads that succeeded after one or more retries
+	 */
+	uint16_t retried;
+
+	/**
+	 * Reads that failed after all retries
+	 */
+	uint16_t failed;
+};
+
 
 void 
 RFID_Init(void);
 
+void 
+RFID_OnTick(void);
+
 uint8_t 
 RFID_IsCardPresent(void);
 
 uint8_t 
-RFID_GetCardStatus(void);
+RFID_GetEvent(struct rfid_event * event);
 
 uint8_t 
-RFID_GetCardId(uint8_t * buffer);
+RFID_GetCardStatus(uint8_t * status);
+
+void 
+RFID_TuneClock(void);
+
+void 
+RFID_BeginReadId(uint8_t * buffer, uint8_t * length);
+
+uint8_t 
+RFID_PollReadId(void);
+
+void 
+RFID_CancelRead(void);
+
+uint8_t 
+RFID_GetCardId(uint8_t * buffer, uint8_t * length);
+
+void 
+RFID_SetPolicy(const struct rfid_policy * p);
+
+void 
+RFID_SavePolicy(void);
+
+void 
+RFID_GetStats(struct rfid_stats * s);
 
 #endif
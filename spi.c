@@ -4,6 +4,15 @@ spi.c
 
 This file contains functions related to SPI communication.
 
+Transfers are queued with SPI_Submit and run from the SPI
+interrupt, one byte per slave select. Between two transfers
+the line is idle for at least SPI_GUARD_MS, which is 
+counted down by the system tick instead of a busy delay.
+
+Between SPI_BeginFrame and SPI_EndFrame slave select is 
+held low and transfers follow each other without a guard
+time. The caller paces them, e.g. by a data ready line.
+
 Version: 	1
 Author: 	Jacob Pedersen
 Company:	IHK
@@ -11,20 +20,180 @@ Date:		2012-12-01
 
 --------------------------------------------------------*/
 
-#include <avr/wdt.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "bits.h"
 #include "spi.h"
 
 /**
- * Function used to empty possibly waiting data on the SPI
- * lines.
+ * States of a transfer slot
+ */
+enum spi_slot_state_t { slot_free, slot_queued, slot_active, slot_done };
+
+/**
+ * A single byte transfer
+ */
+struct spi_transfer {
+	/**
+	 * Byte to send
+	 */
+	uint8_t tx;
+
+	/**
+	 * Byte received while sending
+	 */
+	uint8_t rx;
+
+	/**
+	 * Completion callback, or 0 if the byte is collected with SPI_Collect
+	 */
+	spi_done_t done;
+
+	/**
+	 * Slot state
+	 */
+	volatile enum spi_slot_state_t state;
+};
+
+/**
+ * The transfer queue
+ */
+static struct spi_transfer queue[SPI_QUEUE_SIZE];
+
+/**
+ * Next slot to submit into
+ */
+static uint8_t head;
+
+/**
+ * Next slot to put on the wire
+ */
+static volatile uint8_t next;
+
+/**
+ * Non-zero while a transfer is on the wire or its callback runs.
+ * Set by the StartNext that starts a transfer, so only one can.
+ */
+static volatile uint8_t busy;
+
+/**
+ * Ticks left of the guard time
+ */
+static volatile uint8_t guard;
+
+/**
+ * Non-zero between SPI_BeginFrame and SPI_EndFrame
+ */
+static volatile uint8_t framed;
+
+/**
+ * Non-zero while slave select is held low by a frame
+ */
+static volatile uint8_t held;
+
+/**
+ * Current clock setting
+ */
+static uint8_t clock = SPI_CLOCK_DEFAULT;
+
+/**
+ * Starts the next queued transfer if the line is free. Interrupts
+ * are only disabled while the line is claimed. A transfer missed by
+ * a StartNext that lost the claim is started by the next tick.
+ */
+static void 
+StartNext(void)
+{
+	struct spi_transfer * t;
+	uint8_t claimed = 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (!busy)
+		{
+			busy = 1;
+			claimed = 1;
+		}
+	}
+	if (!claimed)
+	{
+		return;
+	}
+
+	t = &queue[next];
+	if ((guard && !held) || t->state != slot_queued)
+	{
+		busy = 0;
+		return;
+	}
+
+	held = framed;
+	t->state = slot_active;
+	clr(PORT_SPI, SPI_SS);
+	SPDR = t->tx;
+}
+
+/**
+ * Releases slave select and starts the guard time. Called while
+ * the line is busy, or with interrupts disabled.
  */
 static void 
-EmptyBuffer(void) 
+Release(void)
+{
+	set(PORT_SPI, SPI_SS);
+	held = 0;
+	// One extra tick, as the first one may be only partial
+	guard = SPI_GUARD_MS + 1;
+}
+
+/**
+ * Transfer complete ISR. Stores the received byte and, unless
+ * a frame is open, releases slave select.
+ *
+ * Only this ISR writes next, and nothing else writes busy while
+ * it is set, so no interrupts need to be disabled here.
+ */
+ISR(SPI_STC_vect, ISR_NOBLOCK)
+{
+	struct spi_transfer * t = &queue[next];
+	spi_done_t done = t->done;
+	uint8_t data = SPDR;
+
+	if (!framed)
+	{
+		Release();
+	}
+
+	t->rx = data;
+	t->state = done ? slot_free : slot_done;
+	next = (next + 1) % SPI_QUEUE_SIZE;
+
+	if (done)
+	{
+		done(data);
+	}
+
+	// Freed after the callback, so callbacks run in transfer order
+	busy = 0;
+	StartNext();
+}
+
+/**
+ * Counts down the guard time. Called from the system tick.
+ */
+void 
+SPI_OnTick(void)
 {
-	while((PIND & (1 << 3)) != 0) 
+	// Release may set the guard from the SPI interrupt
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		SPI_Receive();
+		if (guard)
+		{
+			guard--;
+		}
 	}
+	StartNext();
 }
 
 /**
@@ -40,50 +209,154 @@ SPI_Init(void)
 	 * SS 		Output
 	 */
  	DDR_SPI = (1<<DD_MOSI) | (1<<DD_SCK) | (1<<DD_SS);
+ 	set(PORT_SPI, SPI_SS);
 
 	/*
+	 * SPIE		SPI Interrupt Enable
 	 * SPE 		SPI Enable
 	 * MSTR		SPI Master Mode
-	 * SPR1		f_osc / 64
 	 */
-	SPCR = (1<<SPE) | (1<<MSTR) | (1<<SPR1);
+	SPCR = (1<<SPIE) | (1<<SPE) | (1<<MSTR);
+	SPI_SetClock(clock);
 }
 
 /**
- * Transmits the given data. A delay of 5 milliseconds
- * is hardcoded in the the of the function.
- * 
- * @param data The data to send
+ * Sets the SPI clock. Waits for a running transfer to finish.
+ *
+ * Even settings below SPI_CLOCK_SLOWEST use the double speed bit,
+ * e.g. 4 is f_osc / 32 = SPI2X with f_osc / 64.
+ *
+ * @param setting The clock setting, SPI_CLOCK_FASTEST to SPI_CLOCK_SLOWEST
  */
 void 
-SPI_Transmit(uint8_t data) 
+SPI_SetClock(uint8_t setting)
 {
-	EmptyBuffer();
-	PORT_SPI &= (0<<SPI_SS);
-	SPDR = data;
-	while(!(SPSR & (1<<SPIF)))
+	while (busy)
 	{
 		// Do nothing
 	}
-	PORT_SPI |= (1<<SPI_SS);
-	_delay_ms(5);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		clock = setting;
+		SPCR = (SPCR & ~((1<<SPR1) | (1<<SPR0))) | (setting >> 1);
+
+		if ((setting & 1) == 0 && setting != SPI_CLOCK_SLOWEST)
+		{
+			SPSR |= (1<<SPI2X);
+		}
+		else
+		{
+			SPSR &= ~(1<<SPI2X);
+		}
+	}
+}
+
+/**
+ * @return The current clock setting
+ */
+uint8_t 
+SPI_GetClock(void)
+{
+	return clock;
 }
 
 /**
- * Receive a byte on the SPI connection.
+ * Queues a byte for transmission. The transfer starts as soon
+ * as the transfers before it are done and the guard time is over.
+ * 
+ * If a callback is given, it receives the reply and the slot is 
+ * freed by the interrupt. Otherwise the reply must be fetched with
+ * SPI_IsComplete and SPI_Collect.
  *
+ * @param data The data to send
+ * @param done Completion callback, or 0
+ * @return Handle of the transfer, or SPI_NO_HANDLE if the queue is full
+ */
+uint8_t 
+SPI_Submit(uint8_t data, spi_done_t done)
+{
+	uint8_t handle = SPI_NO_HANDLE;
+
+	// Claim the slot. It is only filled in after, as a free slot
+	// is not touched by the interrupt
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (queue[head].state == slot_free)
+		{
+			handle = head;
+			head = (head + 1) % SPI_QUEUE_SIZE;
+		}
+	}
+
+	if (handle != SPI_NO_HANDLE)
+	{
+		queue[handle].tx = data;
+		queue[handle].done = done;
+		queue[handle].state = slot_queued;
+		StartNext();
+	}
+
+	return handle;
+}
+
+/**
+ * @param handle Handle returned by SPI_Submit
+ * @return Non-zero if the transfer is done
+ */
+uint8_t 
+SPI_IsComplete(uint8_t handle)
+{
+	return queue[handle].state == slot_done;
+}
+
+/**
+ * Returns the byte received during a completed transfer and 
+ * frees its slot. 
+ *
+ * @param handle Handle of a completed transfer
  * @return The received byte
  */
 uint8_t 
-SPI_Receive(void) 
+SPI_Collect(uint8_t handle)
+{
+	uint8_t data = queue[handle].rx;
+	queue[handle].state = slot_free;
+	return data;
+}
+
+/**
+ * Opens a frame. Slave select is pulled low by the next transfer
+ * and held until SPI_EndFrame, with no guard time between transfers.
+ */
+void 
+SPI_BeginFrame(void)
+{
+	framed = 1;
+}
+
+/**
+ * Closes a frame. Slave select is released when the running
+ * transfer, if any, is done.
+ */
+void 
+SPI_EndFrame(void)
 {
-	PORT_SPI &= (0<<SPI_SS);
-	SPDR = 0xF5;
-	while(!(SPSR & (1<<SPIF)))
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		// Do nothing
+		framed = 0;
+		if (held && !busy)
+		{
+			Release();
+		}
 	}
-	PORT_SPI |= (1<<SPI_SS);
-	_delay_ms(5);
-	return SPDR;
+}
+
+/**
+ * @return Non-zero if no transfer is running and the guard time is over
+ */
+uint8_t 
+SPI_IsIdle(void)
+{
+	return !busy && !guard;
 }
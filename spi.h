@@ -1,4 +1,3 @@
-	
 #ifndef _SPI_H_
 #define _SPI_H_
 
@@ -15,13 +14,69 @@
 #define DD_SS 		DDB4
 #define SPI_SS 		PB4
 
+/**
+ * Byte clocked out when we only want to receive
+ */
+#define SPI_FILLER			0xF5
+
+/**
+ * Minimum time between two transfers in milliseconds. 
+ * The RFID reader needs this to get ready for the next byte.
+ */
+#define SPI_GUARD_MS		5
+
+/**
+ * Number of transfers that can be queued at once
+ */
+#define SPI_QUEUE_SIZE		8
+
+/**
+ * Returned by SPI_Submit when the queue is full
+ */
+#define SPI_NO_HANDLE		0xFF
+
+/**
+ * SPI clock settings. The clock is f_osc / (2 << clock), from
+ * f_osc / 2 for SPI_CLOCK_FASTEST to f_osc / 128 for SPI_CLOCK_SLOWEST.
+ */
+#define SPI_CLOCK_FASTEST	0
+#define SPI_CLOCK_DEFAULT	5
+#define SPI_CLOCK_SLOWEST	6
+
+/**
+ * Completion callback. Called from the SPI interrupt with the
+ * received byte.
+ */
+typedef void (*spi_done_t)(uint8_t data);
+
 void 
 SPI_Init(void);
 
 void 
-SPI_Transmit(uint8_t data);
+SPI_SetClock(uint8_t clock);
+
+uint8_t 
+SPI_GetClock(void);
+
+uint8_t 
+SPI_Submit(uint8_t data, spi_done_t done);
+
+uint8_t 
+SPI_IsComplete(uint8_t handle);
+
+uint8_t 
+SPI_Collect(uint8_t handle);
+
+void 
+SPI_BeginFrame(void);
+
+void 
+SPI_EndFrame(void);
 
 uint8_t 
-SPI_Receive(void);
+SPI_IsIdle(void);
+
+void 
+SPI_OnTick(void);
 
 #endif
@@ -14,9 +14,9 @@ Date:		2012-12-01
 #include "config.h"
 #include <stdint.h>
 #include <string.h>
-#include <stdio.h>
 #include <avr/io.h>
 #include <avr/wdt.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 
 #include "usbdrv/usbdrv.h"
@@ -24,13 +24,35 @@ Date:		2012-12-01
 #include "common.h"
 #include "lcd.h"
 #include "rfid.h"
+#include "tick.h"
 
 #define BTN_PRESSED ( (BTN_PORT & (1 << BTN_PIN)) == 0 )
 
+/**
+ * Set to 1 to add the format benchmark. It links in sprintf,
+ * which the rest of the firmware does without.
+ */
+#ifndef TEST_FORMAT_BENCHMARK
+#define TEST_FORMAT_BENCHMARK 0
+#endif
+
+#if TEST_FORMAT_BENCHMARK
+#include <stdio.h>
+#endif
+
+/**
+ * Number of numbers formatted by each side of the format benchmark
+ */
+#define FORMAT_RUNS 1000
+
 /**
  * Possible test states
  */
-enum test_state_t { button, display, usb, buzzer, rfid };
+enum test_state_t { button, display, usb, buzzer, rfid,
+#if TEST_FORMAT_BENCHMARK
+	format
+#endif
+};
 
 /**
  * echo_buffer from main.c
@@ -42,6 +64,12 @@ extern uint8_t echo_buffer[8];
  */
 extern volatile uint8_t echo_ready;
 
+/**
+ * Strings used by more than one test
+ */
+static const char s_ok[] PROGMEM = "OK";
+static const char s_next[] PROGMEM = "Press for next";
+
 /**
  * Current test state
  */
@@ -64,16 +92,13 @@ delay_long(uint8_t c)
 }
 
 static void 
-printOnLine(const char * str, uint8_t line)
+printOnLine(PGM_P str, uint8_t line)
 {
-	LCD_GotoXY(0, line);
-	LCD_PutString("              ");
-	LCD_GotoXY(0, line);
-	LCD_PutString(str);
+	LCD_PutLine_P(str, line);
 }
 
 static void 
-printState(const char * str)
+printState(PGM_P str)
 {
 	printOnLine(str, 0);
 }
@@ -81,24 +106,42 @@ printState(const char * str)
 static void 
 printCounterLineTwo(uint8_t i)
 {
-	char buf[16];
-	sprintf(buf, "i: %d", i);
-	printOnLine(buf, 1);
+	LCD_PutLine_P(PSTR("i: "), 1);
+	LCD_GotoXY(3, 1);
+	LCD_PutDecimal(i, 0, 0);
+}
+
+/**
+ * Writes a byte as two lower case hex digits at the cursor.
+ */
+static void 
+printHex(uint8_t value)
+{
+	uint8_t i, digit;
+
+	for (i = 0; i < 2; i++)
+	{
+		digit = i ? value & 0x0F : value >> 4;
+		LCD_PutChar(digit < 10 ? '0' + digit : 'a' - 10 + digit);
+	}
 }
 
 void
 test(void)
 {
-	uint8_t i, r;
-	uint8_t card[8];
-	char buf[16];
+	uint8_t i, r, length;
+	uint8_t card[RFID_ID_MAX_LENGTH];
+#if TEST_FORMAT_BENCHMARK
+	uint16_t n, start, elapsed;
+	char buf[17];
+#endif
 
 	GREEN_ON;
 
 	// Wait for the user to release the button
 	while (BTN_PRESSED);
 
-	printState("Press to start");
+	printState(PSTR("Press to start"));
 	waitForPressAndRelease();
 
 	for (;;)
@@ -107,11 +150,11 @@ test(void)
 		{
 			case button:
 			{
-				printState("Test: button");
-				printOnLine("", 0);
+				printState(PSTR("Test: button"));
+				printOnLine(PSTR(""), 0);
 
 				delay_long(100);
-				printState("Press 10 times");
+				printState(PSTR("Press 10 times"));
 
 				i = 0;
 				for (; i < 10; i++)
@@ -122,8 +165,8 @@ test(void)
 
 				printCounterLineTwo(i + 1);	
 
-				printOnLine("OK", 0);
-				printOnLine("Press for next", 1);
+				printOnLine(s_ok, 0);
+				printOnLine(s_next, 1);
 
 				waitForPressAndRelease();
 				state = display;
@@ -132,13 +175,18 @@ test(void)
 			}
 			case display:
 			{
-				printState("Test: display");
-				printOnLine("", 1);
+				printState(PSTR("Test: display"));
+				printOnLine(PSTR(""), 1);
 				
 				delay_long(100);
 
-				printOnLine("OK", 0);
-				printOnLine("Press for next", 1);
+				printOnLine(PSTR(""), 0);
+				LCD_Marquee_P(PSTR("Scrolling by display shift, press to stop"), 1, 250);
+				waitForPressAndRelease();
+				LCD_MarqueeStop();
+
+				printOnLine(s_ok, 0);
+				printOnLine(s_next, 1);
 				waitForPressAndRelease();
 				state = usb;
 
@@ -148,11 +196,11 @@ test(void)
 			{
 				i = 0;
 
-				printState("Test: usb");
-				printOnLine("Echo 100 bytes", 1);
+				printState(PSTR("Test: usb"));
+				printOnLine(PSTR("Echo 100 bytes"), 1);
 
 				delay_long(100);
-				printOnLine("Press to skip", 1);
+				printOnLine(PSTR("Press to skip"), 1);
 
 				for (;;)
 				{	
@@ -183,8 +231,8 @@ test(void)
 					}
 				}	
 				
-				printOnLine("OK", 0);
-				printOnLine("Press for next", 1);
+				printOnLine(s_ok, 0);
+				printOnLine(s_next, 1);
 				waitForPressAndRelease();
 
 				state = buzzer;
@@ -193,8 +241,8 @@ test(void)
 			}
 			case buzzer: 
 			{
-				printState("Test: buzzer");
-				printOnLine("", 1);
+				printState(PSTR("Test: buzzer"));
+				printOnLine(PSTR(""), 1);
 
 				delay_long(100);
 
@@ -228,8 +276,8 @@ test(void)
 
 				delay_long(100);
 
-				printOnLine("OK", 0);
-				printOnLine("Press for next", 1);
+				printOnLine(s_ok, 0);
+				printOnLine(s_next, 1);
 
 				waitForPressAndRelease();
 				state = rfid;
@@ -238,32 +286,86 @@ test(void)
 			}
 			case rfid: 
 			{
-				printState("Test: rfid");
-				printOnLine("Scan card", 1);
+				printState(PSTR("Test: rfid"));
+				printOnLine(PSTR("Scan card"), 1);
 
 				while (!RFID_IsCardPresent());
 				_delay_ms(100);
 
-				r = RFID_GetCardId(card);
-				if (r == -1) 
+				r = RFID_GetCardId(card, &length);
+				if (r != RFID_OK) 
 				{
-					printOnLine("FAILURE!", 1);
+					printOnLine(PSTR("FAILURE!"), 1);
 				}
 				else
 				{
-					sprintf(buf, "0x%x%x%x%x%x%x%x%x", card[7], card[6], card[5], card[4], card[3], card[2], card[1], card[0]);
-					printOnLine(buf, 1);
+					// Last byte first. Up to 8 bytes fit on the line.
+					printOnLine(PSTR(""), 1);
+					LCD_GotoXY(0, 1);
+					for (i = 0; i < length && i < 8; i++)
+					{
+						printHex(card[length - 1 - i]);
+					}
 				}
 
 				delay_long(255);
-				printOnLine("OK", 0);
-				printOnLine("Press for next", 1);
+				printOnLine(s_ok, 0);
+				printOnLine(s_next, 1);
+
+				waitForPressAndRelease();
+#if TEST_FORMAT_BENCHMARK
+				state = format;
+#else
+				state = button;
+#endif
+
+				break;
+			}
+#if TEST_FORMAT_BENCHMARK
+			case format:
+			{
+				printState(PSTR("Test: format"));
+				printOnLine(PSTR("Running"), 1);
+
+				// Format the same balance with sprintf and with the
+				// display's own formatter. Both go through the shadow,
+				// so only the formatting itself is measured.
+				start = Tick_Now();
+				for (n = 0; n < FORMAT_RUNS; n++)
+				{
+					sprintf_P(buf, PSTR("Saldo %7ld kr"), -12345L);
+					LCD_PutLine(buf, 1);
+				}
+				elapsed = Tick_Now() - start;
+				LCD_PutLine_P(PSTR("printf"), 0);
+				LCD_GotoXY(6, 0);
+				LCD_PutDecimal(elapsed, 0, 7);
+				LCD_PutString_P(PSTR(" ms"));
+
+				start = Tick_Now();
+				for (n = 0; n < FORMAT_RUNS; n++)
+				{
+					LCD_GotoXY(0, 1);
+					LCD_PutString_P(PSTR("Saldo "));
+					LCD_PutDecimal(-12345L, 0, 7);
+					LCD_PutString_P(PSTR(" kr"));
+				}
+				elapsed = Tick_Now() - start;
+				LCD_PutLine_P(PSTR("lcd"), 1);
+				LCD_GotoXY(6, 1);
+				LCD_PutDecimal(elapsed, 0, 7);
+				LCD_PutString_P(PSTR(" ms"));
+
+				waitForPressAndRelease();
+				printOnLine(s_ok, 0);
+				printOnLine(s_next, 1);
 
 				waitForPressAndRelease();
 				state = button;
 
 				break;
 			}
+#endif
 		}
 	}
 
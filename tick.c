@@ -0,0 +1,83 @@
+/*--------------------------------------------------------
+
+tick.c
+
+This file contains the system tick. TIMER2 runs in CTC
+mode and interrupts once every millisecond. The tick 
+drives the time based parts of the drivers, such as the
+SPI guard time, the RFID data ready check and the LCD
+output queue.
+
+Version: 	1
+Author: 	Jacob Pedersen
+Company:	IHK
+Date:		2012-12-01
+
+--------------------------------------------------------*/
+
+#include "config.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "tick.h"
+#include "spi.h"
+#include "rfid.h"
+#include "lcd.h"
+
+/**
+ * Milliseconds since Tick_Init. Wraps around every 65 seconds.
+ */
+static volatile uint16_t ticks;
+
+/**
+ * System tick ISR. Non-blocking so the USB interrupt is never
+ * held back by the drivers called from here.
+ */
+ISR(TIMER2_COMP_vect, ISR_NOBLOCK)
+{
+	ticks++;
+	SPI_OnTick();
+	RFID_OnTick();
+	LCD_OnTick();
+}
+
+/**
+ * Initializes TIMER2 as the system tick.
+ */
+void 
+Tick_Init(void)
+{
+	OCR2 = TICK_OCR;
+	TCCR2 = (1 << WGM21) | (1 << CS22); // CTC, 64 prescaler
+	TIMSK |= (1 << OCIE2);
+}
+
+/**
+ * @return The current tick count in milliseconds
+ */
+uint16_t 
+Tick_Now(void)
+{
+	uint16_t now;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		now = ticks;
+	}
+	return now;
+}
+
+/**
+ * Checks if a deadline has passed. Deadlines are made by adding
+ * a number of milliseconds to Tick_Now(), and must be less than
+ * 32 seconds into the future.
+ *
+ * @param deadline The tick count to compare against
+ * @return Non-zero if the deadline has passed
+ */
+uint8_t 
+Tick_Expired(uint16_t deadline)
+{
+	return (int16_t)(Tick_Now() - deadline) >= 0;
+}
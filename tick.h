@@ -0,0 +1,30 @@
+#ifndef _TICK_H_
+#define _TICK_H_
+
+#include "config.h"
+#include <stdint.h>
+
+/**
+ * Frequency of the system tick in Hz. One tick is one millisecond.
+ */
+#define TICK_HZ			1000
+
+/**
+ * TIMER2 compare value giving TICK_HZ with a 64 prescaler
+ */
+#define TICK_OCR		((F_CPU / 64 / TICK_HZ) - 1)
+
+#if TICK_OCR > 255
+	#error "F_CPU too high for an 8-bit TIMER2 tick with prescaler 64"
+#endif
+
+void 
+Tick_Init(void);
+
+uint16_t 
+Tick_Now(void);
+
+uint8_t 
+Tick_Expired(uint16_t deadline);
+
+#endif
@@ -3,7 +3,9 @@
 usb.c
 
 This file contains functions related to setting of the USB 
-library. Rest of the USB related functions required by VUSB
+library, and the queues of events for interrupt endpoint 1
+and of telemetry for interrupt endpoint 3.
+Rest of the USB related functions required by VUSB
 library is implemented in main.c
 
 Version:    1
@@ -15,14 +17,90 @@ Date:       2012-12-01
 
 #include "config.h"
 
+#include <stdint.h>
+#include <string.h>
 #include <avr/io.h>
 #include <avr/wdt.h>
 #include <avr/interrupt.h>
 #include <util/delay.h> 
  
 #include "usb.h"
+#include "common.h"
 #include "usbdrv/usbdrv.h"
 
+/**
+ * Queue of packets for an interrupt endpoint
+ */
+struct packet_queue
+{
+	/**
+	 * The packets
+	 */
+	uint8_t packets[USB_EVENT_QUEUE_SIZE][EVENT_PACKET_SIZE];
+
+	/**
+	 * Number of bytes in each packet
+	 */
+	uint8_t length[USB_EVENT_QUEUE_SIZE];
+
+	/**
+	 * Next packet to write. Only changed by queuePut.
+	 */
+	volatile uint8_t head;
+
+	/**
+	 * Next packet to send. Only changed by USB_PollEvents.
+	 */
+	volatile uint8_t tail;
+};
+
+/**
+ * Events for endpoint 1
+ */
+static struct packet_queue events;
+
+/**
+ * Telemetry for endpoint 3
+ */
+static struct packet_queue telemetry;
+
+/**
+ * Queues data in packets of up to EVENT_PACKET_SIZE bytes. The
+ * packets are queued together or not at all.
+ *
+ * @param q The queue
+ * @param data The data
+ * @param length Number of bytes
+ * @return Non-zero if queued, zero if the queue is full
+ */
+static uint8_t 
+queuePut(struct packet_queue * q, const uint8_t * data, uint8_t length)
+{
+	uint8_t packets = (length + EVENT_PACKET_SIZE - 1) / EVENT_PACKET_SIZE;
+	uint8_t used = (uint8_t)(q->head - q->tail) % USB_EVENT_QUEUE_SIZE;
+	uint8_t head = q->head;
+	uint8_t n;
+
+	// One entry is kept free to tell a full queue from an empty one
+	if (used + packets >= USB_EVENT_QUEUE_SIZE)
+	{
+		return 0;
+	}
+
+	while (length > 0)
+	{
+		n = length > EVENT_PACKET_SIZE ? EVENT_PACKET_SIZE : length;
+		memcpy(q->packets[head], data, n);
+		q->length[head] = n;
+		head = (head + 1) % USB_EVENT_QUEUE_SIZE;
+		data += n;
+		length -= n;
+	}
+
+	q->head = head;
+	return 1;
+}
+
 /**
  * Initialize the USB library and connect to the host
  */
@@ -44,3 +122,66 @@ USB_InitAndConnect()
     sei();
 }
 
+/**
+ * Queues an event for the interrupt endpoint. Events longer than
+ * EVENT_PACKET_SIZE are split into packets, which are queued 
+ * together or not at all.
+ *
+ * @param data The event
+ * @param length Number of bytes in the event
+ * @return Non-zero if queued, zero if the queue is full
+ */
+uint8_t 
+USB_QueueEvent(const uint8_t * data, uint8_t length)
+{
+	return queuePut(&events, data, length);
+}
+
+/**
+ * Queues a telemetry record for endpoint 3. Telemetry is only 
+ * sent while there are no events for endpoint 1.
+ *
+ * @param data The record, at most EVENT_PACKET_SIZE bytes
+ * @param length Number of bytes in the record
+ * @return Non-zero if queued, zero if the queue is full
+ */
+uint8_t 
+USB_QueueTelemetry(const uint8_t * data, uint8_t length)
+{
+	if (length > EVENT_PACKET_SIZE)
+	{
+		return 0;
+	}
+
+	return queuePut(&telemetry, data, length);
+}
+
+/**
+ * Hands the next queued packet to the USB driver when the host 
+ * has collected the previous one. Telemetry goes out only when 
+ * endpoint 1 is idle with nothing queued. Called right after usbPoll.
+ */
+void 
+USB_PollEvents(void)
+{
+	uint8_t tail = events.tail;
+
+	if (!usbInterruptIsReady())
+	{
+		return;
+	}
+
+	if (tail != events.head)
+	{
+		usbSetInterrupt(events.packets[tail], events.length[tail]);
+		events.tail = (tail + 1) % USB_EVENT_QUEUE_SIZE;
+		return;
+	}
+
+	tail = telemetry.tail;
+	if (tail != telemetry.head && usbInterruptIsReady3())
+	{
+		usbSetInterrupt3(telemetry.packets[tail], telemetry.length[tail]);
+		telemetry.tail = (tail + 1) % USB_EVENT_QUEUE_SIZE;
+	}
+}
@@ -2,9 +2,26 @@
 #ifndef _USB_H_
 #define _USB_H_
 
+#include <stdint.h>
+
+/**
+ * Number of packets the event and telemetry queues hold. Must 
+ * be a power of two.
+ */
+#define USB_EVENT_QUEUE_SIZE	8
+
 void 
 USB_InitAndConnect(void);
 
+uint8_t 
+USB_QueueEvent(const uint8_t * data, uint8_t length);
+
+uint8_t 
+USB_QueueTelemetry(const uint8_t * data, uint8_t length);
+
+void 
+USB_PollEvents(void);
+
 #endif
 
 